@@ -15,6 +15,12 @@
 #include <linux/delay.h>
 #include <linux/pm.h>
 #include <linux/i2c.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/regmap.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/interrupt.h>
 #include <linux/platform_device.h>
 #include <linux/spi/spi.h>
 #include <linux/acpi.h>
@@ -29,6 +35,7 @@
 #include <sound/tlv.h>
 #include <asm/intel-mid.h>
 #include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
 
 #define RTK_IOCTL
 #ifdef RTK_IOCTL
@@ -44,10 +51,14 @@
 /* #define USE_INT_CLK */
 #define JD1_FUNC
 /* #define ALC_DRC_FUNC */
+/* #define REG_BURST */ /* multi-register I2C writes, register address auto-increments */
+/* #define PRIV_AUTO_INC */ /* PRIV_INDEX advances after each PRIV_DATA access */
 
 #define RT5648_REG_RW 1 /* for debug */
 
-#define USE_ASRC
+static bool force_asrc;
+module_param(force_asrc, bool, 0644);
+MODULE_PARM_DESC(force_asrc, "Run every stream through ASRC");
 
 #define VERSION "0.0.3 alsa 1.0.25"
 
@@ -94,8 +105,6 @@ struct rt5648_init_reg {
 static struct rt5648_init_reg init_list[] = {
 	//{ RT5648_DIG_MISC	, 0x0121 },
 	{ RT5648_ADDA_CLK1	, 0x0000 },
-	{ RT5648_PRIV_INDEX	, 0x003d },
-	{ RT5648_PRIV_DATA	, 0x3600 },
 	/* playback */
 	{ RT5648_DAC_CTRL	, 0x0011 },
 #ifdef CONFIG_TF103CG
@@ -180,6 +189,11 @@ static struct rt5648_init_reg init_list[] = {
 };
 #define RT5648_INIT_REG_LEN ARRAY_SIZE(init_list)
 
+static struct rt5648_init_reg index_init_list[] = {
+	{ RT5648_CHOP_DAC_ADC	, 0x3600 },
+};
+#define RT5648_INDEX_INIT_REG_LEN ARRAY_SIZE(index_init_list)
+
 #ifdef ALC_DRC_FUNC
 static struct rt5648_init_reg alc_drc_list[] = {
 	{ RT5648_ALC_DRC_CTRL1	, 0x0000 },
@@ -192,137 +206,731 @@ static struct rt5648_init_reg alc_drc_list[] = {
 #define RT5648_ALC_DRC_REG_LEN ARRAY_SIZE(alc_drc_list)
 #endif
 
+static int rt5648_index_write(struct snd_soc_codec *codec,
+		unsigned int reg, unsigned int value);
+
+/**
+ * rt5648_reg_init - Program the init sequence.
+ * @codec: SoC audio codec device.
+ *
+ * The init tables are only recorded in the register cache and then sent
+ * out by regcache_sync() in address order.  Values that match the reset
+ * defaults are dropped and, with REG_BURST, contiguous ranges go out as
+ * multi-register writes.  The hardware must be at its reset state.
+ *
+ * Returns 0 for success or negative error code.
+ */
 static int rt5648_reg_init(struct snd_soc_codec *codec)
 {
-	int i;
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+	unsigned int val;
+	ktime_t start = ktime_get();
+	int i, ret;
+
+	/* the read-modify-write targets below must be cached */
+	regmap_read(rt5648->regmap, RT5648_PWR_ANLG1, &val);
+	regmap_read(rt5648->regmap, RT5648_GEN_CTRL3, &val);
 
+	regcache_cache_only(rt5648->regmap, true);
 	for (i = 0; i < RT5648_INIT_REG_LEN; i++)
 		snd_soc_write(codec, init_list[i].reg, init_list[i].val);
 #ifdef ALC_DRC_FUNC
 	for (i = 0; i < RT5648_ALC_DRC_REG_LEN; i++)
 		snd_soc_write(codec, alc_drc_list[i].reg, alc_drc_list[i].val);
 #endif
+	snd_soc_update_bits(codec, RT5648_PWR_ANLG1, RT5648_LDO_SEL_MASK, 0x0);
+	snd_soc_update_bits(codec, RT5648_GEN_CTRL3, 0x2, 0x2);
+	regcache_cache_only(rt5648->regmap, false);
+
+	ret = regcache_sync(rt5648->regmap);
+	if (ret < 0) {
+		dev_err(codec->dev, "Failed to sync init registers: %d\n", ret);
+		return ret;
+	}
+
+	for (i = 0; i < RT5648_INDEX_INIT_REG_LEN; i++) {
+		ret = rt5648_index_write(codec, index_init_list[i].reg,
+			index_init_list[i].val);
+		if (ret < 0)
+			return ret;
+	}
+
+	dev_dbg(codec->dev, "%s(): done in %lld us\n", __func__,
+		ktime_us_delta(ktime_get(), start));
 
 	return 0;
 }
 
-static int rt5648_index_sync(struct snd_soc_codec *codec)
+static const struct reg_default rt5648_reg[] = {
+	{ RT5648_HP_VOL, 0xc8c8 },
+	{ RT5648_SPK_VOL, 0xc8c8 },
+	{ RT5648_LOUT1, 0xc8c8 },
+	{ RT5648_CJ_CTRL1, 0x0002 },
+	{ RT5648_CJ_CTRL2, 0x0827 },
+	{ RT5648_CJ_CTRL3, 0xe000 },
+	{ RT5648_INL1_INR1_VOL, 0x0808 },
+	{ RT5648_SPK_FUNC_LIM, 0x3333 },
+	{ RT5648_ADJ_HPF_CTRL, 0x4b00 },
+	{ RT5648_SIDETONE_CTRL, 0x018b },
+	{ RT5648_DAC1_DIG_VOL, 0xafaf },
+	{ RT5648_DAC2_DIG_VOL, 0xafaf },
+	{ RT5648_DAC_CTRL, 0x0001 },
+	{ RT5648_STO1_ADC_DIG_VOL, 0x2f2f },
+	{ RT5648_MONO_ADC_DIG_VOL, 0x2f2f },
+	{ RT5648_STO1_ADC_MIXER, 0x7060 },
+	{ RT5648_MONO_ADC_MIXER, 0x7070 },
+	{ RT5648_AD_DA_MIXER, 0x8080 },
+	{ RT5648_STO_DAC_MIXER, 0x5656 },
+	{ RT5648_MONO_DAC_MIXER, 0x5454 },
+	{ RT5648_DIG_MIXER, 0xaaa0 },
+	{ RT5648_DIG_INF1_DATA, 0x1002 },
+	{ RT5648_PDM_OUT_CTRL, 0x5000 },
+	{ RT5648_REC_L2_MIXER, 0x007f },
+	{ RT5648_REC_R2_MIXER, 0x007f },
+	{ RT5648_HPOMIXL_CTRL, 0x001f },
+	{ RT5648_HPOMIXR_CTRL, 0x001f },
+	{ RT5648_HPO_MIXER, 0x6000 },
+	{ RT5648_SPK_L_MIXER, 0x003e },
+	{ RT5648_SPK_R_MIXER, 0x003e },
+	{ RT5648_SPO_MIXER, 0xf807 },
+	{ RT5648_SPO_CLSD_RATIO, 0x0004 },
+	{ RT5648_OUT_L1_MIXER, 0x01ff },
+	{ RT5648_OUT_R1_MIXER, 0x01ff },
+	{ RT5648_LOUT_MIXER, 0xf000 },
+	{ RT5648_HAPTIC_CTRL1, 0x0111 },
+	{ RT5648_HAPTIC_CTRL2, 0x0064 },
+	{ RT5648_HAPTIC_CTRL3, 0xef0e },
+	{ RT5648_HAPTIC_CTRL4, 0xf0f0 },
+	{ RT5648_HAPTIC_CTRL5, 0xef0e },
+	{ RT5648_HAPTIC_CTRL6, 0xf0f0 },
+	{ RT5648_HAPTIC_CTRL7, 0xef0e },
+	{ RT5648_HAPTIC_CTRL8, 0xf0f0 },
+	{ RT5648_HAPTIC_CTRL9, 0xf000 },
+	{ RT5648_PWR_DIG1, 0x0300 },
+	{ RT5648_PWR_ANLG1, 0x00c2 },
+	{ RT5648_I2S1_SDP, 0x8000 },
+	{ RT5648_I2S2_SDP, 0x8000 },
+	{ RT5648_I2S3_SDP, 0x8000 },
+	{ RT5648_ADDA_CLK1, 0x1110 },
+	{ RT5648_ADDA_CLK2, 0x3e00 },
+	{ RT5648_DMIC_CTRL1, 0x2409 },
+	{ RT5648_DMIC_CTRL2, 0x000a },
+	{ RT5648_TDM_CTRL_3, 0x0123 },
+	{ RT5648_ASRC_3, 0x0000 },
+	{ RT5648_DEPOP_M1, 0x0004 },
+	{ RT5648_DEPOP_M2, 0x1100 },
+	{ RT5648_DEPOP_M3, 0x0646 },
+	{ RT5648_CHARGE_PUMP, 0x0c06 },
+	{ RT5648_MICBIAS, 0x3000 },
+	{ RT5648_A_JD_CTRL1, 0x0200 },
+	{ RT5648_VAD_CTRL1, 0x2184 },
+	{ RT5648_VAD_CTRL2, 0x010a },
+	{ RT5648_VAD_CTRL3, 0x0aea },
+	{ RT5648_VAD_CTRL4, 0x000c },
+	{ RT5648_VAD_CTRL5, 0x0400 },
+	{ RT5648_CLSD_OUT_CTRL, 0xa0a8 },
+	{ RT5648_CLSD_OUT_CTRL1, 0x0059 },
+	{ RT5648_CLSD_OUT_CTRL2, 0x0001 },
+	{ RT5648_ADC_EQ_CTRL1, 0x6000 },
+	{ RT5648_EQ_CTRL1, 0x6000 },
+	{ RT5648_ALC_DRC_CTRL2, 0x001f },
+	{ RT5648_ALC_CTRL_1, 0x020c },
+	{ RT5648_ALC_CTRL_2, 0x1f00 },
+	{ RT5648_ALC_CTRL_4, 0x4000 },
+	{ RT5648_GPIO_CTRL4, 0x2000 },
+	{ RT5648_BASE_BACK, 0x1813 },
+	{ RT5648_MP3_PLUS1, 0x0690 },
+	{ RT5648_MP3_PLUS2, 0x1c17 },
+	{ RT5648_ADJ_HPF1, 0xb320 },
+	{ RT5648_HP_CALIB_AMP_DET, 0x0400 },
+	{ RT5648_SV_ZCD1, 0x0809 },
+	{ RT5648_IL_CMD, 0x0003 },
+	{ RT5648_IL_CMD2, 0x0049 },
+	{ RT5648_IL_CMD3, 0x001b },
+	{ RT5648_DRC1_HL_CTRL1, 0x8000 },
+	{ RT5648_DRC1_HL_CTRL2, 0x0200 },
+	{ RT5648_DRC2_HL_CTRL1, 0x8000 },
+	{ RT5648_DRC2_HL_CTRL2, 0x0200 },
+	{ RT5648_MUTI_DRC_CTRL1, 0x0f20 },
+	{ RT5648_ADC_MONO_HP_CTRL1, 0xb300 },
+	{ RT5648_DRC2_CTRL1, 0x001f },
+	{ RT5648_DRC2_CTRL2, 0x020c },
+	{ RT5648_DRC2_CTRL3, 0x1f00 },
+	{ RT5648_DRC2_CTRL5, 0x4000 },
+	{ RT5648_DIG_MISC, 0x2060 },
+};
+
+static bool rt5648_volatile_register(struct device *dev, unsigned int reg)
 {
-	int i;
+	switch (reg) {
+	case RT5648_RESET:
+	case RT5648_PRIV_INDEX:
+	case RT5648_PRIV_DATA:
+	case RT5648_A_JD_CTRL1:
+	case RT5648_IRQ_CTRL3:
+	case RT5648_INT_IRQ_ST:
+	case RT5648_HP_CALIB_AMP_DET:
+	case RT5648_IL_CMD:
+	case RT5648_VENDOR_ID:
+	case RT5648_VENDOR_ID1:
+	case RT5648_VENDOR_ID2:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool rt5648_readable_register(struct device *dev, unsigned int reg)
+{
+	switch (reg) {
+	case RT5648_RESET:
+	case RT5648_VENDOR_ID:
+	case RT5648_VENDOR_ID1:
+	case RT5648_VENDOR_ID2:
+	case RT5648_SPK_VOL:
+	case RT5648_HP_VOL:
+	case RT5648_LOUT1:
+	case RT5648_CJ_CTRL1:
+	case RT5648_CJ_CTRL2:
+	case RT5648_CJ_CTRL3:
+	case RT5648_IN1_IN2:
+	case RT5648_IN3:
+	case RT5648_INL1_INR1_VOL:
+	case RT5648_SPK_FUNC_LIM:
+	case RT5648_ADJ_HPF_CTRL:
+	case RT5648_SIDETONE_CTRL:
+	case RT5648_DAC1_DIG_VOL:
+	case RT5648_DAC2_DIG_VOL:
+	case RT5648_DAC_CTRL:
+	case RT5648_STO1_ADC_DIG_VOL:
+	case RT5648_MONO_ADC_DIG_VOL:
+	case RT5648_ADC_BST_VOL1:
+	case RT5648_ADC_BST_VOL2:
+	case RT5648_STO1_ADC_MIXER:
+	case RT5648_MONO_ADC_MIXER:
+	case RT5648_AD_DA_MIXER:
+	case RT5648_STO_DAC_MIXER:
+	case RT5648_MONO_DAC_MIXER:
+	case RT5648_DIG_MIXER:
+	case RT5648_DSP_PATH1:
+	case RT5648_DSP_PATH2:
+	case RT5648_DIG_INF1_DATA:
+	case RT5648_PDM_OUT_CTRL:
+	case RT5648_PDM_DATA_CTRL1:
+	case RT5648_PDM1_DATA_CTRL2:
+	case RT5648_PDM1_DATA_CTRL3:
+	case RT5648_PDM1_DATA_CTRL4:
+	case RT5648_PDM2_DATA_CTRL2:
+	case RT5648_PDM2_DATA_CTRL3:
+	case RT5648_PDM2_DATA_CTRL4:
+	case RT5648_REC_L1_MIXER:
+	case RT5648_REC_L2_MIXER:
+	case RT5648_REC_R1_MIXER:
+	case RT5648_REC_R2_MIXER:
+	case RT5648_HPMIXL_CTRL:
+	case RT5648_HPOMIXL_CTRL:
+	case RT5648_HPMIXR_CTRL:
+	case RT5648_HPOMIXR_CTRL:
+	case RT5648_HPO_MIXER:
+	case RT5648_SPK_L_MIXER:
+	case RT5648_SPK_R_MIXER:
+	case RT5648_SPO_MIXER:
+	case RT5648_SPO_CLSD_RATIO:
+	case RT5648_OUT_L_GAIN1:
+	case RT5648_OUT_L_GAIN2:
+	case RT5648_OUT_L1_MIXER:
+	case RT5648_OUT_R_GAIN1:
+	case RT5648_OUT_R_GAIN2:
+	case RT5648_OUT_R1_MIXER:
+	case RT5648_LOUT_MIXER:
+	case RT5648_HAPTIC_CTRL1:
+	case RT5648_HAPTIC_CTRL2:
+	case RT5648_HAPTIC_CTRL3:
+	case RT5648_HAPTIC_CTRL4:
+	case RT5648_HAPTIC_CTRL5:
+	case RT5648_HAPTIC_CTRL6:
+	case RT5648_HAPTIC_CTRL7:
+	case RT5648_HAPTIC_CTRL8:
+	case RT5648_HAPTIC_CTRL9:
+	case RT5648_HAPTIC_CTRL10:
+	case RT5648_PWR_DIG1:
+	case RT5648_PWR_DIG2:
+	case RT5648_PWR_ANLG1:
+	case RT5648_PWR_ANLG2:
+	case RT5648_PWR_MIXER:
+	case RT5648_PWR_VOL:
+	case RT5648_PRIV_INDEX:
+	case RT5648_PRIV_DATA:
+	case RT5648_I2S1_SDP:
+	case RT5648_I2S2_SDP:
+	case RT5648_I2S3_SDP:
+	case RT5648_ADDA_CLK1:
+	case RT5648_ADDA_CLK2:
+	case RT5648_DMIC_CTRL1:
+	case RT5648_DMIC_CTRL2:
+	case RT5648_TDM_CTRL_1:
+	case RT5648_TDM_CTRL_2:
+	case RT5648_TDM_CTRL_3:
+	case RT5648_GLB_CLK:
+	case RT5648_PLL_CTRL1:
+	case RT5648_PLL_CTRL2:
+	case RT5648_ASRC_1:
+	case RT5648_ASRC_2:
+	case RT5648_ASRC_3:
+	case RT5648_ASRC_8:
+	case RT5648_DEPOP_M1:
+	case RT5648_DEPOP_M2:
+	case RT5648_DEPOP_M3:
+	case RT5648_CHARGE_PUMP:
+	case RT5648_MICBIAS:
+	case RT5648_A_JD_CTRL1:
+	case RT5648_A_JD_CTRL2:
+	case RT5648_VAD_CTRL1:
+	case RT5648_VAD_CTRL2:
+	case RT5648_VAD_CTRL3:
+	case RT5648_VAD_CTRL4:
+	case RT5648_VAD_CTRL5:
+	case RT5648_CLSD_OUT_CTRL:
+	case RT5648_CLSD_OUT_CTRL1:
+	case RT5648_CLSD_OUT_CTRL2:
+	case RT5648_ADC_EQ_CTRL1:
+	case RT5648_ADC_EQ_CTRL2:
+	case RT5648_EQ_CTRL1:
+	case RT5648_EQ_CTRL2:
+	case RT5648_ALC_DRC_CTRL1:
+	case RT5648_ALC_DRC_CTRL2:
+	case RT5648_ALC_CTRL_1:
+	case RT5648_ALC_CTRL_2:
+	case RT5648_ALC_CTRL_3:
+	case RT5648_ALC_CTRL_4:
+	case RT5648_JD_CTRL:
+	case RT5648_IRQ_CTRL1:
+	case RT5648_IRQ_CTRL2:
+	case RT5648_IRQ_CTRL3:
+	case RT5648_INT_IRQ_ST:
+	case RT5648_GPIO_CTRL1:
+	case RT5648_GPIO_CTRL2:
+	case RT5648_GPIO_CTRL3:
+	case RT5648_GPIO_CTRL4:
+	case RT5648_SCRABBLE_FUN:
+	case RT5648_SCRABBLE_CTRL:
+	case RT5648_BASE_BACK:
+	case RT5648_MP3_PLUS1:
+	case RT5648_MP3_PLUS2:
+	case RT5648_ADJ_HPF1:
+	case RT5648_ADJ_HPF2:
+	case RT5648_HP_CALIB_AMP_DET:
+	case RT5648_SV_ZCD1:
+	case RT5648_SV_ZCD2:
+	case RT5648_IL_CMD:
+	case RT5648_IL_CMD2:
+	case RT5648_IL_CMD3:
+	case RT5648_DRC1_HL_CTRL1:
+	case RT5648_DRC1_HL_CTRL2:
+	case RT5648_DRC2_HL_CTRL1:
+	case RT5648_DRC2_HL_CTRL2:
+	case RT5648_MUTI_DRC_CTRL1:
+	case RT5648_ADC_MONO_HP_CTRL1:
+	case RT5648_ADC_MONO_HP_CTRL2:
+	case RT5648_DRC2_CTRL1:
+	case RT5648_DRC2_CTRL2:
+	case RT5648_DRC2_CTRL3:
+	case RT5648_DRC2_CTRL4:
+	case RT5648_DRC2_CTRL5:
+	case RT5648_JD_CTRL3:
+	case RT5648_JD_CTRL4:
+	case RT5648_DIG_MISC:
+	case RT5648_GEN_CTRL2:
+	case RT5648_GEN_CTRL3:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool rt5648_writeable_register(struct device *dev, unsigned int reg)
+{
+	switch (reg) {
+	case RT5648_VENDOR_ID:
+	case RT5648_VENDOR_ID1:
+	case RT5648_VENDOR_ID2:
+		return false;
+	default:
+		return rt5648_readable_register(dev, reg);
+	}
+}
+
+/*
+ * PRIV_DATA is a window onto the private register selected by PRIV_INDEX,
+ * so it must never be read behind the driver's back (e.g. debugfs dumps).
+ */
+static bool rt5648_precious_register(struct device *dev, unsigned int reg)
+{
+	switch (reg) {
+	case RT5648_PRIV_DATA:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * io_lock is the lock of the main register map, so every register access
+ * takes it, and its owner may take it again.  That lets a hwdep register
+ * program hold it from its first record to its last.  Private register
+ * accesses take it before pr_lock.  Lock order: cache_lock, io_lock,
+ * pr_lock.
+ */
+static void rt5648_io_lock(void *data)
+{
+	struct rt5648_priv *rt5648 = data;
+
+	if (READ_ONCE(rt5648->io_owner) == current) {
+		rt5648->io_depth++;
+		return;
+	}
+	mutex_lock(&rt5648->io_lock);
+	rt5648->io_owner = current;
+	rt5648->io_depth = 1;
+}
+
+static void rt5648_io_unlock(void *data)
+{
+	struct rt5648_priv *rt5648 = data;
+
+	if (--rt5648->io_depth)
+		return;
+	rt5648->io_owner = NULL;
+	mutex_unlock(&rt5648->io_lock);
+}
+
+static void rt5648_pr_lock(struct rt5648_priv *rt5648)
+{
+	rt5648_io_lock(rt5648);
+	mutex_lock(&rt5648->pr_lock);
+}
+
+static void rt5648_pr_unlock(struct rt5648_priv *rt5648)
+{
+	mutex_unlock(&rt5648->pr_lock);
+	rt5648_io_unlock(rt5648);
+}
+
+/*
+ * Keep the register mirror exported by the hwdep node in step with the
+ * caches.
+ */
+static void rt5648_mirror(struct rt5648_priv *rt5648, bool index,
+		unsigned int reg, unsigned int value)
+{
+#ifdef RTK_IOCTL
+#if defined(CONFIG_SND_HWDEP) || defined(CONFIG_SND_HWDEP_MODULE)
+	rt_codec_reg_page_update(rt5648->reg_page, index ?
+		RT_CODEC_SPACE_INDEX : RT_CODEC_SPACE_REG, reg, value);
+#endif
+#endif
+}
+
+#ifdef RTK_IOCTL
+#if defined(CONFIG_SND_HWDEP) || defined(CONFIG_SND_HWDEP_MODULE)
+static struct rt_codec_reg_page *rt5648_get_reg_page(
+		struct snd_soc_codec *codec)
+{
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+
+	return rt5648->reg_page;
+}
+
+static void rt5648_prog_lock(struct snd_soc_codec *codec)
+{
+	rt5648_io_lock(snd_soc_codec_get_drvdata(codec));
+}
+
+static void rt5648_prog_unlock(struct snd_soc_codec *codec)
+{
+	rt5648_io_unlock(snd_soc_codec_get_drvdata(codec));
+}
+
+static int rt5648_space_read(struct snd_soc_codec *codec, int space,
+		unsigned int reg, unsigned int *value)
+{
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+	bool index = space == RT_CODEC_SPACE_INDEX;
+	int ret;
+
+	if (index) {
+		rt5648_pr_lock(rt5648);
+		ret = regmap_read(rt5648->pr_regmap, reg, value);
+		rt5648_pr_unlock(rt5648);
+	} else {
+		ret = regmap_read(rt5648->regmap, reg, value);
+	}
+	if (ret < 0)
+		return ret;
+	rt5648_mirror(rt5648, index, reg, *value);
 
-	for (i = 0; i < RT5648_INIT_REG_LEN; i++)
-		if (RT5648_PRIV_INDEX == init_list[i].reg ||
-			RT5648_PRIV_DATA == init_list[i].reg)
-			snd_soc_write(codec, init_list[i].reg,
-					init_list[i].val);
 	return 0;
 }
+#endif
+#endif
+
+/*
+ * ASoC and the driver both use the main regmap directly.  Its bus is a
+ * plain I2C bus that also mirrors every value it moves for the hwdep
+ * node, so the mirror follows the hardware: cache hits cost nothing and
+ * writes made while cache-only show up once they are synced.  Buffers
+ * are a register byte followed by big-endian values, one per register
+ * from there on (several only with REG_BURST).
+ */
+static void rt5648_bus_mirror(struct rt5648_priv *rt5648, unsigned int reg,
+		const u8 *val, size_t val_size)
+{
+	size_t i;
+
+	for (i = 0; i + 1 < val_size; i += 2)
+		rt5648_mirror(rt5648, false, reg++, val[i] << 8 | val[i + 1]);
+}
 
-static const u16 rt5648_reg[RT5648_VENDOR_ID2 + 1] = {
-	[RT5648_HP_VOL] = 0xc8c8,
-	[RT5648_SPK_VOL] = 0xc8c8,
-	[RT5648_LOUT1] = 0xc8c8,
-	[RT5648_CJ_CTRL1] = 0x0002,
-	[RT5648_CJ_CTRL2] = 0x0827,
-	[RT5648_CJ_CTRL3] = 0xe000,
-	[RT5648_INL1_INR1_VOL] = 0x0808,
-	[RT5648_SPK_FUNC_LIM] = 0x3333,
-	[RT5648_ADJ_HPF_CTRL] = 0x4b00,
-	[RT5648_SIDETONE_CTRL] = 0x018b,
-	[RT5648_DAC1_DIG_VOL] = 0xafaf,
-	[RT5648_DAC2_DIG_VOL] = 0xafaf,
-	[RT5648_DAC_CTRL] = 0x0001,
-	[RT5648_STO1_ADC_DIG_VOL] = 0x2f2f,
-	[RT5648_MONO_ADC_DIG_VOL] = 0x2f2f,
-	[RT5648_STO1_ADC_MIXER] = 0x7060,
-	[RT5648_MONO_ADC_MIXER] = 0x7070,
-	[RT5648_AD_DA_MIXER] = 0x8080,
-	[RT5648_STO_DAC_MIXER] = 0x5656,
-	[RT5648_MONO_DAC_MIXER] = 0x5454,
-	[RT5648_DIG_MIXER] = 0xaaa0,
-	[RT5648_DIG_INF1_DATA] = 0x1002,
-	[RT5648_PDM_OUT_CTRL] = 0x5000,
-	[RT5648_REC_L2_MIXER] = 0x007f,
-	[RT5648_REC_R2_MIXER] = 0x007f,
-	[RT5648_HPOMIXL_CTRL] = 0x001f,
-	[RT5648_HPOMIXR_CTRL] = 0x001f,
-	[RT5648_HPO_MIXER] = 0x6000,
-	[RT5648_SPK_L_MIXER] = 0x003e,
-	[RT5648_SPK_R_MIXER] = 0x003e,
-	[RT5648_SPO_MIXER] = 0xf807,
-	[RT5648_SPO_CLSD_RATIO] = 0x0004,
-	[RT5648_OUT_L1_MIXER] = 0x01ff,
- 	[RT5648_OUT_R1_MIXER] = 0x01ff,
-	[RT5648_LOUT_MIXER] = 0xf000,
-	[RT5648_HAPTIC_CTRL1] = 0x0111,
-	[RT5648_HAPTIC_CTRL2] = 0x0064,
-	[RT5648_HAPTIC_CTRL3] = 0xef0e,
-	[RT5648_HAPTIC_CTRL4] = 0xf0f0,
-	[RT5648_HAPTIC_CTRL5] = 0xef0e,
-	[RT5648_HAPTIC_CTRL6] = 0xf0f0,
-	[RT5648_HAPTIC_CTRL7] = 0xef0e,
-	[RT5648_HAPTIC_CTRL8] = 0xf0f0,
-	[RT5648_HAPTIC_CTRL9] = 0xf000,
-	[RT5648_PWR_DIG1] = 0x0300,
-	[RT5648_PWR_ANLG1] = 0x00c2,
-	[RT5648_I2S1_SDP] = 0x8000,
-	[RT5648_I2S2_SDP] = 0x8000,
-	[RT5648_I2S3_SDP] = 0x8000,
-	[RT5648_ADDA_CLK1] = 0x1110,
-	[RT5648_ADDA_CLK2] = 0x3e00,
-	[RT5648_DMIC_CTRL1] = 0x2409,
-	[RT5648_DMIC_CTRL2] = 0x000a,
-	[RT5648_TDM_CTRL_3] = 0x0123,
-	[RT5648_ASRC_3] = 0x0000,
-	[RT5648_DEPOP_M1] = 0x0004,
-	[RT5648_DEPOP_M2] = 0x1100,
-	[RT5648_DEPOP_M3] = 0x0646,
-	[RT5648_CHARGE_PUMP] = 0x0c06,
-	[RT5648_MICBIAS] = 0x3000,
-	[RT5648_A_JD_CTRL1] = 0x0200,
-	[RT5648_VAD_CTRL1] = 0x2184,
-	[RT5648_VAD_CTRL2] = 0x010a,
-	[RT5648_VAD_CTRL3] = 0x0aea,
-	[RT5648_VAD_CTRL4] = 0x000c,
-	[RT5648_VAD_CTRL5] = 0x0400,
-	[RT5648_CLSD_OUT_CTRL] = 0xa0a8,
-	[RT5648_CLSD_OUT_CTRL1] = 0x0059,
-	[RT5648_CLSD_OUT_CTRL2] = 0x0001,
-	[RT5648_ADC_EQ_CTRL1] = 0x6000,
-	[RT5648_EQ_CTRL1] = 0x6000,
-	[RT5648_ALC_DRC_CTRL2] = 0x001f,
-	[RT5648_ALC_CTRL_1] = 0x020c,
-	[RT5648_ALC_CTRL_2] = 0x1f00,
-	[RT5648_ALC_CTRL_4] = 0x4000,
-	[RT5648_INT_IRQ_ST] = 0x0180,
-	[RT5648_GPIO_CTRL4] = 0x2000,
-	[RT5648_BASE_BACK] = 0x1813,
-	[RT5648_MP3_PLUS1] = 0x0690,
-	[RT5648_MP3_PLUS2] = 0x1c17,
-	[RT5648_ADJ_HPF1] = 0xb320,
-	[RT5648_HP_CALIB_AMP_DET] = 0x0400,
-	[RT5648_SV_ZCD1] = 0x0809,
-	[RT5648_IL_CMD] = 0x0003,
-	[RT5648_IL_CMD2] = 0x0049,
-	[RT5648_IL_CMD3] = 0x001b,
-	[RT5648_DRC1_HL_CTRL1] = 0x8000,
-	[RT5648_DRC1_HL_CTRL2] = 0x0200,
-	[RT5648_DRC2_HL_CTRL1] = 0x8000,
-	[RT5648_DRC2_HL_CTRL2] = 0x0200,
-	[RT5648_MUTI_DRC_CTRL1] = 0x0f20,
-	[RT5648_ADC_MONO_HP_CTRL1] = 0xb300,
-	[RT5648_DRC2_CTRL1] = 0x001f,
-	[RT5648_DRC2_CTRL2] = 0x020c,
-	[RT5648_DRC2_CTRL3] = 0x1f00,
-	[RT5648_DRC2_CTRL5] = 0x4000,
-	[RT5648_DIG_MISC] = 0x2060,
+static int rt5648_bus_write(void *context, const void *data, size_t count)
+{
+	struct rt5648_priv *rt5648 = context;
+	const u8 *buf = data;
+	int ret;
+
+	ret = i2c_master_send(rt5648->i2c, data, count);
+	if (ret != count)
+		return ret < 0 ? ret : -EIO;
+	rt5648_bus_mirror(rt5648, buf[0], buf + 1, count - 1);
+
+	return 0;
+}
+
+static int rt5648_bus_read(void *context, const void *reg_buf,
+		size_t reg_size, void *val_buf, size_t val_size)
+{
+	struct rt5648_priv *rt5648 = context;
+	struct i2c_msg msg[2];
+	int ret;
+
+	msg[0].addr = rt5648->i2c->addr;
+	msg[0].flags = 0;
+	msg[0].len = reg_size;
+	msg[0].buf = (u8 *)reg_buf;
+	msg[1].addr = rt5648->i2c->addr;
+	msg[1].flags = I2C_M_RD;
+	msg[1].len = val_size;
+	msg[1].buf = val_buf;
+
+	ret = i2c_transfer(rt5648->i2c->adapter, msg, ARRAY_SIZE(msg));
+	if (ret != ARRAY_SIZE(msg))
+		return ret < 0 ? ret : -EIO;
+	rt5648_bus_mirror(rt5648, *(const u8 *)reg_buf, val_buf, val_size);
+
+	return 0;
+}
+
+static const struct regmap_bus rt5648_bus = {
+	.write = rt5648_bus_write,
+	.read = rt5648_bus_read,
 };
 
+static struct regmap *rt5648_get_regmap(struct device *dev)
+{
+	struct rt5648_priv *rt5648 = dev_get_drvdata(dev);
+
+	return rt5648->regmap;
+}
+
+/*
+ * Seed the mirror with every non-volatile register.  Cached values are
+ * used where present, anything not cached yet is read from the codec.
+ */
+static void rt5648_mirror_init(struct rt5648_priv *rt5648)
+{
+	unsigned int reg, value;
+
+	for (reg = 0; reg <= RT5648_VENDOR_ID2; reg++) {
+		if (!rt5648_readable_register(NULL, reg) ||
+			rt5648_volatile_register(NULL, reg))
+			continue;
+		if (regmap_read(rt5648->regmap, reg, &value) == 0)
+			rt5648_mirror(rt5648, false, reg, value);
+	}
+}
+
 static int rt5648_reset(struct snd_soc_codec *codec)
 {
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+
+	rt5648->pr_index = -1;
 	return snd_soc_write(codec, RT5648_RESET, 0);
 }
 
+/*
+ * Private registers are reached through the PRIV_INDEX/PRIV_DATA window of
+ * the main register map.  They are modelled as a second regmap so that
+ * reads and read-modify-write cycles are served from its cache and only
+ * real changes reach the bus.
+ *
+ * The index last written is tracked in pr_index so it is only reloaded
+ * when it does not already point at the target.  While a burst is open,
+ * writes are queued and sent as a single multi-message i2c_transfer().
+ * pr_lock covers pr_index, the burst queue and pr_stats, so every driver
+ * access to pr_regmap takes it, through rt5648_pr_lock().
+ *
+ * What a burst saves depends on PRIV_AUTO_INC.  Without it every register
+ * still costs an index and a data message, so the bytes on the bus stay
+ * the same and only the per-transfer overhead goes away.  With it a run
+ * of consecutive registers costs one index message plus one data message
+ * per register, close to half the bus time.  The pr_stats sysfs node
+ * reports the counts and the duration of the last bulk write.
+ */
+#define RT5648_PR_BURST_MAX 64
+
+struct rt5648_pr_burst {
+	bool active;
+	int num;
+	u8 buf[RT5648_PR_BURST_MAX][3];
+	struct i2c_msg msg[RT5648_PR_BURST_MAX];
+};
+
+static void rt5648_pr_index_advance(struct rt5648_priv *rt5648)
+{
+#ifdef PRIV_AUTO_INC
+	if (rt5648->pr_index >= 0)
+		rt5648->pr_index++;
+#endif
+}
+
+static void rt5648_pr_burst_queue(struct rt5648_priv *rt5648,
+		unsigned int reg, unsigned int val)
+{
+	struct rt5648_pr_burst *burst = rt5648->pr_burst;
+	struct i2c_msg *msg = &burst->msg[burst->num];
+	u8 *buf = burst->buf[burst->num];
+
+	buf[0] = reg;
+	buf[1] = val >> 8;
+	buf[2] = val & 0xff;
+	msg->addr = rt5648->i2c->addr;
+	msg->flags = 0;
+	msg->len = 3;
+	msg->buf = buf;
+	burst->num++;
+}
+
+static int rt5648_pr_burst_flush(struct rt5648_priv *rt5648)
+{
+	struct rt5648_pr_burst *burst = rt5648->pr_burst;
+	int ret;
+
+	if (!burst->num)
+		return 0;
+
+	ret = i2c_transfer(rt5648->i2c->adapter, burst->msg, burst->num);
+	rt5648->pr_stats.xfers++;
+	if (ret != burst->num) {
+		rt5648->pr_index = -1;
+		ret = ret < 0 ? ret : -EIO;
+	} else {
+		ret = 0;
+	}
+	burst->num = 0;
+
+	return ret;
+}
+
+static int rt5648_pr_set_index(struct rt5648_priv *rt5648, unsigned int reg)
+{
+	int ret;
+
+	if (rt5648->pr_index == reg) {
+		rt5648->pr_stats.index_skipped++;
+		return 0;
+	}
+
+	rt5648->pr_stats.index_msgs++;
+	rt5648->pr_stats.xfers++;
+	ret = regmap_write(rt5648->regmap, RT5648_PRIV_INDEX, reg);
+	if (ret < 0) {
+		rt5648->pr_index = -1;
+		return ret;
+	}
+	rt5648->pr_index = reg;
+
+	return 0;
+}
+
+static int rt5648_pr_reg_read(void *context, unsigned int reg,
+		unsigned int *val)
+{
+	struct rt5648_priv *rt5648 = context;
+	int ret;
+
+	ret = rt5648_pr_burst_flush(rt5648);
+	if (ret < 0)
+		return ret;
+
+	ret = rt5648_pr_set_index(rt5648, reg);
+	if (ret < 0)
+		return ret;
+
+	rt5648->pr_stats.reads++;
+	rt5648->pr_stats.xfers++;
+	ret = regmap_read(rt5648->regmap, RT5648_PRIV_DATA, val);
+	rt5648_pr_index_advance(rt5648);
+
+	return ret;
+}
+
+static int rt5648_pr_reg_write(void *context, unsigned int reg,
+		unsigned int val)
+{
+	struct rt5648_priv *rt5648 = context;
+	struct rt5648_pr_burst *burst = rt5648->pr_burst;
+	int ret;
+
+	rt5648->pr_stats.writes++;
+	if (burst->active) {
+		if (burst->num + 2 > RT5648_PR_BURST_MAX) {
+			ret = rt5648_pr_burst_flush(rt5648);
+			if (ret < 0)
+				return ret;
+		}
+		if (rt5648->pr_index != reg) {
+			rt5648_pr_burst_queue(rt5648, RT5648_PRIV_INDEX, reg);
+			rt5648->pr_index = reg;
+			rt5648->pr_stats.index_msgs++;
+		} else {
+			rt5648->pr_stats.index_skipped++;
+		}
+		rt5648_pr_burst_queue(rt5648, RT5648_PRIV_DATA, val);
+		rt5648_pr_index_advance(rt5648);
+		return 0;
+	}
+
+	ret = rt5648_pr_set_index(rt5648, reg);
+	if (ret < 0)
+		return ret;
+
+	rt5648->pr_stats.xfers++;
+	ret = regmap_write(rt5648->regmap, RT5648_PRIV_DATA, val);
+	rt5648_pr_index_advance(rt5648);
+
+	return ret;
+}
+
+static bool rt5648_pr_volatile_register(struct device *dev, unsigned int reg)
+{
+	switch (reg) {
+	case RT5648_HP_DCC_INT1:
+		/* kicks off HP DC calibration, bits self-clear */
+		return true;
+	default:
+		return false;
+	}
+}
+
 /**
  * rt5648_index_write - Write private register.
  * @codec: SoC audio codec device.
@@ -337,21 +945,17 @@ static int rt5648_reset(struct snd_soc_codec *codec)
 static int rt5648_index_write(struct snd_soc_codec *codec,
 		unsigned int reg, unsigned int value)
 {
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
 	int ret;
 
-	ret = snd_soc_write(codec, RT5648_PRIV_INDEX, reg);
-	if (ret < 0) {
-		dev_err(codec->dev, "Failed to set private addr: %d\n", ret);
-		goto err;
-	}
-	ret = snd_soc_write(codec, RT5648_PRIV_DATA, value);
-	if (ret < 0) {
+	rt5648_pr_lock(rt5648);
+	ret = regmap_write(rt5648->pr_regmap, reg, value);
+	rt5648_pr_unlock(rt5648);
+	if (ret < 0)
 		dev_err(codec->dev, "Failed to set private value: %d\n", ret);
-		goto err;
-	}
-	return 0;
+	else
+		rt5648_mirror(rt5648, true, reg, value);
 
-err:
 	return ret;
 }
 
@@ -360,22 +964,29 @@ err:
  * @codec: SoC audio codec device.
  * @reg: Private register index.
  *
- * Read advanced setting from private register. It can be read through
- * private index (0x6a) and data (0x6c) register.
+ * Read advanced setting from private register. Cached values are returned
+ * without bus access; otherwise it is read through private index (0x6a)
+ * and data (0x6c) register.
  *
  * Returns private register value or negative error code.
  */
 static unsigned int rt5648_index_read(
 	struct snd_soc_codec *codec, unsigned int reg)
 {
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+	unsigned int value;
 	int ret;
 
-	ret = snd_soc_write(codec, RT5648_PRIV_INDEX, reg);
+	rt5648_pr_lock(rt5648);
+	ret = regmap_read(rt5648->pr_regmap, reg, &value);
+	rt5648_pr_unlock(rt5648);
 	if (ret < 0) {
-		dev_err(codec->dev, "Failed to set private addr: %d\n", ret);
+		dev_err(codec->dev, "Failed to read private reg: %d\n", ret);
 		return ret;
 	}
-	return snd_soc_read(codec, RT5648_PRIV_DATA);
+	rt5648_mirror(rt5648, true, reg, value);
+
+	return value;
 }
 
 /**
@@ -385,37 +996,227 @@ static unsigned int rt5648_index_read(
  * @mask: register mask
  * @value: new value
  *
- * Writes new register value.
+ * Writes new register value. Nothing is written if the cached value
+ * already matches.
  *
  * Returns 1 for change, 0 for no change, or negative error code.
  */
 static int rt5648_index_update_bits(struct snd_soc_codec *codec,
 	unsigned int reg, unsigned int mask, unsigned int value)
 {
-	unsigned int old, new;
-	int change, ret;
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+	unsigned int new;
+	bool change;
+	int ret;
 
-	ret = rt5648_index_read(codec, reg);
+	rt5648_pr_lock(rt5648);
+	ret = regmap_update_bits_check(rt5648->pr_regmap, reg, mask, value,
+		&change);
+	if (ret == 0 && !rt5648_pr_volatile_register(NULL, reg) &&
+		regmap_read(rt5648->pr_regmap, reg, &new) == 0)
+		rt5648_mirror(rt5648, true, reg, new);
+	rt5648_pr_unlock(rt5648);
 	if (ret < 0) {
-		dev_err(codec->dev, "Failed to read private reg: %d\n", ret);
-		goto err;
+		dev_err(codec->dev, "Failed to write private reg: %d\n", ret);
+		return ret;
 	}
 
-	old = ret;
-	new = (old & ~mask) | (value & mask);
-	change = old != new;
-	if (change) {
-		ret = rt5648_index_write(codec, reg, new);
-		if (ret < 0) {
-			dev_err(codec->dev,
-				"Failed to write private reg: %d\n", ret);
-			goto err;
-		}
-	}
 	return change;
+}
 
-err:
-	return ret;
+/**
+ * rt5648_index_bulk_write - Write a list of private registers.
+ * @codec: SoC audio codec device.
+ * @reg: Private register indexes.
+ * @value: Private register data.
+ * @num: Number of registers.
+ *
+ * All writes go out in as few i2c transfers as possible.  PRIV_INDEX is
+ * only reloaded where it does not already point at the next register.
+ *
+ * Returns 0 for success or negative error code.
+ */
+static int rt5648_index_bulk_write(struct snd_soc_codec *codec,
+	const unsigned int *reg, const unsigned int *value, int num)
+{
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+	ktime_t start = ktime_get();
+	int i, ret = 0;
+
+	rt5648_pr_lock(rt5648);
+	rt5648->pr_burst->active = true;
+	for (i = 0; i < num; i++) {
+		ret = regmap_write(rt5648->pr_regmap, reg[i], value[i]);
+		if (ret < 0)
+			break;
+	}
+	rt5648->pr_burst->active = false;
+	if (!ret) {
+		ret = rt5648_pr_burst_flush(rt5648);
+	} else {
+		rt5648->pr_burst->num = 0;
+		rt5648->pr_index = -1;
+	}
+	rt5648->pr_stats.bulk_num = num;
+	rt5648->pr_stats.bulk_us = ktime_us_delta(ktime_get(), start);
+	rt5648_pr_unlock(rt5648);
+
+	if (ret < 0) {
+		dev_err(codec->dev, "Failed to write private regs: %d\n", ret);
+		return ret;
+	}
+	for (i = 0; i < num; i++)
+		rt5648_mirror(rt5648, true, reg[i], value[i]);
+
+	return 0;
+}
+
+/*
+ * While bias is OFF both register maps are cache-only, so mixer and EQ
+ * changes made by an idle device never touch the bus.  The cache is
+ * snapshotted on entry and only registers that changed since are written
+ * back on the next STANDBY transition.
+ */
+static void rt5648_snap_cache(struct regmap *map, struct rt5648_reg_snap *snap)
+{
+	unsigned int reg, val;
+
+	bitmap_zero(snap->valid, RT5648_SNAP_SIZE);
+	for (reg = 0; reg < RT5648_SNAP_SIZE; reg++) {
+		/* misses and volatile registers fail in cache-only mode */
+		if (regmap_read(map, reg, &val))
+			continue;
+		snap->val[reg] = val;
+		set_bit(reg, snap->valid);
+	}
+}
+
+static void rt5648_diff_cache(struct regmap *map, struct rt5648_reg_snap *snap)
+{
+	unsigned int reg, val;
+
+	bitmap_zero(snap->dirty, RT5648_SNAP_SIZE);
+	for (reg = 0; reg < RT5648_SNAP_SIZE; reg++) {
+		if (regmap_read(map, reg, &val))
+			continue;
+		if (!test_bit(reg, snap->valid) || snap->val[reg] != val)
+			set_bit(reg, snap->dirty);
+	}
+}
+
+static int rt5648_flush_cache(struct regmap *map, struct rt5648_reg_snap *snap)
+{
+	unsigned int start, end;
+	int ret;
+
+	for_each_set_bit(start, snap->dirty, RT5648_SNAP_SIZE) {
+		end = find_next_zero_bit(snap->dirty, RT5648_SNAP_SIZE, start);
+		ret = regcache_sync_region(map, start, end - 1);
+		if (ret < 0)
+			return ret;
+		bitmap_clear(snap->dirty, start, end - start);
+	}
+
+	return 0;
+}
+
+static void rt5648_enter_cache_only(struct rt5648_priv *rt5648)
+{
+	mutex_lock(&rt5648->cache_lock);
+	if (!rt5648->cache_only) {
+		regcache_cache_only(rt5648->regmap, true);
+		regcache_cache_only(rt5648->pr_regmap, true);
+		rt5648_snap_cache(rt5648->regmap, rt5648->reg_snap);
+		rt5648_snap_cache(rt5648->pr_regmap, rt5648->pr_snap);
+		rt5648->cache_only = true;
+	}
+	mutex_unlock(&rt5648->cache_lock);
+}
+
+/**
+ * rt5648_leave_cache_only - Return to live register access.
+ * @rt5648: private data.
+ *
+ * Works out which registers were written while cache-only.  They are
+ * written back by rt5648_sync_cache() once the codec is powered up.
+ */
+static void rt5648_leave_cache_only(struct rt5648_priv *rt5648)
+{
+	mutex_lock(&rt5648->cache_lock);
+	if (rt5648->cache_only) {
+		rt5648_diff_cache(rt5648->regmap, rt5648->reg_snap);
+		rt5648_diff_cache(rt5648->pr_regmap, rt5648->pr_snap);
+		regcache_cache_only(rt5648->regmap, false);
+		regcache_cache_only(rt5648->pr_regmap, false);
+		rt5648->cache_only = false;
+	}
+	mutex_unlock(&rt5648->cache_lock);
+}
+
+/**
+ * rt5648_sync_cache - Write back register state.
+ * @rt5648: private data.
+ *
+ * After a reset every register that differs from its default is replayed,
+ * otherwise only those written while cache-only.  Private registers are
+ * sent as one burst.
+ *
+ * Returns 0 for success or negative error code.
+ */
+static int rt5648_sync_cache(struct rt5648_priv *rt5648)
+{
+	bool lost = rt5648->reg_lost;
+	int ret, err;
+
+	if (lost)
+		ret = regcache_sync(rt5648->regmap);
+	else
+		ret = rt5648_flush_cache(rt5648->regmap, rt5648->reg_snap);
+
+	rt5648_pr_lock(rt5648);
+	rt5648->pr_burst->active = true;
+	if (lost)
+		err = regcache_sync(rt5648->pr_regmap);
+	else
+		err = rt5648_flush_cache(rt5648->pr_regmap, rt5648->pr_snap);
+	rt5648->pr_burst->active = false;
+	if (!err) {
+		err = rt5648_pr_burst_flush(rt5648);
+	} else {
+		rt5648->pr_burst->num = 0;
+		rt5648->pr_index = -1;
+	}
+	rt5648_pr_unlock(rt5648);
+
+	rt5648->reg_lost = false;
+
+	return ret ? ret : err;
+}
+
+/**
+ * rt5648_live_io_begin - Allow bus access while cache-only.
+ * @rt5648: private data.
+ *
+ * Jack detection has to read status registers and drive MICBIAS even when
+ * bias is OFF.  Writes made in between go to the hardware and the cache.
+ * Must be paired with rt5648_live_io_end().
+ */
+static void rt5648_live_io_begin(struct rt5648_priv *rt5648)
+{
+	mutex_lock(&rt5648->cache_lock);
+	if (rt5648->cache_only) {
+		regcache_cache_only(rt5648->regmap, false);
+		regcache_cache_only(rt5648->pr_regmap, false);
+	}
+}
+
+static void rt5648_live_io_end(struct rt5648_priv *rt5648)
+{
+	if (rt5648->cache_only) {
+		regcache_cache_only(rt5648->regmap, true);
+		regcache_cache_only(rt5648->pr_regmap, true);
+	}
+	mutex_unlock(&rt5648->cache_lock);
 }
 
 void dc_calibrate(struct snd_soc_codec *codec)
@@ -433,13 +1234,61 @@ void dc_calibrate(struct snd_soc_codec *codec)
                 RT5648_HP_CP_MASK | RT5648_HP_SG_MASK | RT5648_HP_CB_MASK,
                 RT5648_HP_CP_PU | RT5648_HP_SG_DIS | RT5648_HP_CB_PU);
 
-	snd_soc_update_bits(codec, RT5648_GLB_CLK,
-		RT5648_SCLK_SRC_MASK, 0x2 << RT5648_SCLK_SRC_SFT);
-        rt5648_index_write(codec, RT5648_HP_DCC_INT1, 0x9f01);
-	snd_soc_update_bits(codec, RT5648_PWR_ANLG2,
-		RT5648_PWR_MB1, 0);
-	snd_soc_update_bits(codec, RT5648_GLB_CLK,
-		RT5648_SCLK_SRC_MASK, sclk_src);
+	snd_soc_update_bits(codec, RT5648_GLB_CLK,
+		RT5648_SCLK_SRC_MASK, 0x2 << RT5648_SCLK_SRC_SFT);
+        rt5648_index_write(codec, RT5648_HP_DCC_INT1, 0x9f01);
+	snd_soc_update_bits(codec, RT5648_PWR_ANLG2,
+		RT5648_PWR_MB1, 0);
+	snd_soc_update_bits(codec, RT5648_GLB_CLK,
+		RT5648_SCLK_SRC_MASK, sclk_src);
+}
+
+/* MICBIAS settling time before a quiet MB1 means a headset */
+#define RT5648_JD_TIMEOUT_MS			200
+
+/* PWR_ANLG1/2 bits detection turns on, put back for a headphone */
+#define RT5648_JD_ANLG1_MASK \
+	(RT5648_PWR_MB | RT5648_PWR_BG | RT5648_LDO_SEL_MASK)
+#define RT5648_JD_ANLG2_MASK			RT5648_PWR_MB1
+
+/* Called with jd_lock held once MB1 has settled or tripped */
+static void rt5648_jd_finish(struct snd_soc_codec *codec)
+{
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+
+	rt5648_live_io_begin(rt5648);
+	if (snd_soc_read(codec, RT5648_IRQ_CTRL3) & 0x300) {
+		rt5648->jack_type = SND_JACK_HEADPHONE;
+		snd_soc_update_bits(codec, RT5648_IRQ_CTRL3,
+			RT5648_IRQ_MB1_OC_MASK, RT5648_IRQ_MB1_OC_BP);
+		snd_soc_update_bits(codec, RT5648_PWR_ANLG1,
+			RT5648_JD_ANLG1_MASK, rt5648->jd_anlg1);
+		snd_soc_update_bits(codec, RT5648_PWR_ANLG2,
+			RT5648_JD_ANLG2_MASK, rt5648->jd_anlg2);
+	} else {
+		rt5648->jack_type = SND_JACK_HEADSET;
+	}
+	rt5648_live_io_end(rt5648);
+
+	rt5648->jd_state = RT5648_JD_DONE;
+	ret_headset_status = rt5648->jack_type;
+	complete_all(&rt5648->jd_done);
+
+	dev_dbg(codec->dev, "jack type %d\n", rt5648->jack_type);
+	if (rt5648->jack)
+		snd_soc_jack_report(rt5648->jack, rt5648->jack_type,
+			SND_JACK_HEADSET);
+}
+
+static void rt5648_jd_work(struct work_struct *work)
+{
+	struct rt5648_priv *rt5648 =
+		container_of(work, struct rt5648_priv, jd_work.work);
+
+	mutex_lock(&rt5648->jd_lock);
+	if (rt5648->jd_state == RT5648_JD_DETECT)
+		rt5648_jd_finish(rt5648->codec);
+	mutex_unlock(&rt5648->jd_lock);
 }
 
 /**
@@ -447,36 +1296,41 @@ void dc_calibrate(struct snd_soc_codec *codec)
  * @codec: SoC audio codec device.
  * @jack_insert: Jack insert or not.
  *
- * Detect whether is headset or not when jack inserted.
+ * On insertion, power MICBIAS1 and let MB1 over-current tell a headphone
+ * from a headset.  Detection completes on the MB1 interrupt, as decoded by
+ * rt5648_check_interrupt_event() or the jack IRQ, or after
+ * RT5648_JD_TIMEOUT_MS.
  *
- * Returns detect status.
+ * Returns detect status.  With a jack set by rt5648_set_jack_detect() this
+ * is 0 on insertion and the type is reported on the jack instead.
  */
-
 int rt5648_headset_detect(struct snd_soc_codec *codec, int jack_insert)
 {
 	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
-	int reg63, reg64;
+	bool async;
+
+	cancel_delayed_work_sync(&rt5648->jd_work);
 
+	mutex_lock(&rt5648->jd_lock);
+	rt5648_live_io_begin(rt5648);
 	if(jack_insert) {
-		reg63 = snd_soc_read(codec, RT5648_PWR_ANLG1);
-		reg64 = snd_soc_read(codec, RT5648_PWR_ANLG2);
+		rt5648->jd_anlg1 = snd_soc_read(codec, RT5648_PWR_ANLG1);
+		rt5648->jd_anlg2 = snd_soc_read(codec, RT5648_PWR_ANLG2);
 		snd_soc_update_bits(codec, RT5648_PWR_ANLG1,
-			RT5648_PWR_MB | RT5648_PWR_BG | RT5648_LDO_SEL_MASK,
+			RT5648_JD_ANLG1_MASK,
 			RT5648_PWR_MB | RT5648_PWR_BG | 0x2);
 		snd_soc_update_bits(codec, RT5648_PWR_ANLG2,
-			RT5648_PWR_MB1, RT5648_PWR_MB1);
+			RT5648_JD_ANLG2_MASK, RT5648_PWR_MB1);
 		snd_soc_update_bits(codec, RT5648_MICBIAS,
 			RT5648_MIC1_OVCD_MASK, RT5648_MIC1_OVCD_EN);
-		msleep(200);
-		if (snd_soc_read(codec, RT5648_IRQ_CTRL3) & 0x300) {
-			rt5648->jack_type = SND_JACK_HEADPHONE;
-			snd_soc_write(codec, RT5648_PWR_ANLG1, reg63);
-			snd_soc_write(codec, RT5648_PWR_ANLG2, reg64);
-		} else {
-			rt5648->jack_type = SND_JACK_HEADSET;
-			snd_soc_update_bits(codec, RT5648_IRQ_CTRL3,
-				RT5648_IRQ_MB1_OC_MASK, RT5648_IRQ_MB1_OC_NOR);
-		}
+		/* let a headphone's over-current raise the IRQ */
+		snd_soc_update_bits(codec, RT5648_IRQ_CTRL3,
+			RT5648_IRQ_MB1_OC_MASK, RT5648_IRQ_MB1_OC_NOR);
+		rt5648->jack_type = 0;
+		rt5648->jd_state = RT5648_JD_DETECT;
+		reinit_completion(&rt5648->jd_done);
+		schedule_delayed_work(&rt5648->jd_work,
+			msecs_to_jiffies(RT5648_JD_TIMEOUT_MS));
 	} else {
 		snd_soc_update_bits(codec, RT5648_MICBIAS,
 			RT5648_MIC1_OVCD_MASK, RT5648_MIC1_OVCD_DIS);
@@ -488,20 +1342,44 @@ int rt5648_headset_detect(struct snd_soc_codec *codec, int jack_insert)
 			snd_soc_write(codec, RT5648_PWR_ANLG2, 0x0004);
 		}
 	}
+	rt5648_live_io_end(rt5648);
+
+	if (!jack_insert) {
+		rt5648->jd_state = RT5648_JD_IDLE;
+		ret_headset_status = 0;
+		complete_all(&rt5648->jd_done);
+		if (rt5648->jack)
+			snd_soc_jack_report(rt5648->jack, 0, SND_JACK_HEADSET);
+		mutex_unlock(&rt5648->jd_lock);
+		return 0;
+	}
 
-	ret_headset_status = rt5648->jack_type;
+	async = rt5648->jack != NULL;
+	mutex_unlock(&rt5648->jd_lock);
+	if (async)
+		return 0;
+
+	/* no jack to report on, the caller wants the type back */
+	wait_for_completion_timeout(&rt5648->jd_done,
+		msecs_to_jiffies(RT5648_JD_TIMEOUT_MS * 2));
 
 	return rt5648->jack_type;
 }
 EXPORT_SYMBOL(rt5648_headset_detect);
 
-int rt5648_check_interrupt_event(struct snd_soc_codec *codec)
+/*
+ * Turn one INT_IRQ_ST/IRQ_CTRL3 snapshot into a RT5648_*_EVENT.  Called
+ * with jd_lock held; acting on the event is up to the caller, once the
+ * lock is dropped.
+ */
+static int rt5648_irq_decode(struct snd_soc_codec *codec,
+	unsigned int irq_st, unsigned int irq_ctrl3)
 {
 	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
 	int event = RT5648_UN_EVENT;
-	int val;
+	int val = irq_st & 0x1000;
+	int oc = irq_ctrl3 & 0x300;
 
-	val = snd_soc_read(codec, RT5648_INT_IRQ_ST) & 0x1000;
 	if (!rt5648->jd_status) {
 		if (!val) {  /* Jack Insert */
 			rt5648->jd_status = true;
@@ -516,16 +1394,21 @@ int rt5648_check_interrupt_event(struct snd_soc_codec *codec)
 			pr_debug("%s-RT5648_J_OUT_EVENT\n", __func__);
 			return RT5648_J_OUT_EVENT;
 		}
+		if (rt5648->jd_state == RT5648_JD_DETECT) {
+			/* MB1 tripped while typing the jack, finish early */
+			if (oc)
+				mod_delayed_work(system_wq, &rt5648->jd_work, 0);
+			return event;
+		}
 		if (rt5648->jack_type == SND_JACK_HEADSET) {
-			val = snd_soc_read(codec, RT5648_IRQ_CTRL3) & 0x300;
 			if (rt5648->bp_status) {
-				if (!val) {
+				if (!oc) {
 					event = RT5648_BR_EVENT;
 					rt5648->bp_status = false;
 					pr_debug("%s-RT5648_BR_EVENT\n", __func__);
 				}
 			} else {
-				if (val) {
+				if (oc) {
 					event = RT5648_BP_EVENT;
 					rt5648->bp_status = true;
 					pr_debug("%s-RT5648_BP_EVENT\n", __func__);
@@ -536,8 +1419,196 @@ int rt5648_check_interrupt_event(struct snd_soc_codec *codec)
 	pr_debug("%s-EVENT detected:%d\n", __func__, event);
 	return event;
 }
+
+int rt5648_check_interrupt_event(struct snd_soc_codec *codec)
+{
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+	unsigned int irq_st, irq_ctrl3;
+	int event;
+
+	rt5648_live_io_begin(rt5648);
+	irq_st = snd_soc_read(codec, RT5648_INT_IRQ_ST);
+	irq_ctrl3 = snd_soc_read(codec, RT5648_IRQ_CTRL3);
+	rt5648_live_io_end(rt5648);
+
+	mutex_lock(&rt5648->jd_lock);
+	event = rt5648_irq_decode(codec, irq_st, irq_ctrl3);
+	mutex_unlock(&rt5648->jd_lock);
+
+	return event;
+}
 EXPORT_SYMBOL(rt5648_check_interrupt_event);
 
+/* Contact bounce on plug/unplug, and on the headset button */
+#define RT5648_JD_DEBOUNCE_MS			100
+#define RT5648_BTN_DEBOUNCE_MS			20
+
+static void rt5648_jack_work(struct work_struct *work)
+{
+	struct rt5648_priv *rt5648 =
+		container_of(work, struct rt5648_priv, jack_work.work);
+	struct snd_soc_codec *codec = rt5648->codec;
+	int event;
+
+	mutex_lock(&rt5648->jd_lock);
+	event = rt5648_irq_decode(codec, rt5648->irq_st, rt5648->irq_ctrl3);
+	mutex_unlock(&rt5648->jd_lock);
+
+	/* rt5648_headset_detect() takes jd_lock itself */
+	switch (event) {
+	case RT5648_J_IN_EVENT:
+		rt5648_headset_detect(codec, 1);
+		break;
+	case RT5648_J_OUT_EVENT:
+		rt5648_headset_detect(codec, 0);
+		snd_soc_jack_report(rt5648->jack, 0, SND_JACK_BTN_0);
+		break;
+	case RT5648_BP_EVENT:
+		snd_soc_jack_report(rt5648->jack, SND_JACK_BTN_0,
+			SND_JACK_BTN_0);
+		break;
+	case RT5648_BR_EVENT:
+		snd_soc_jack_report(rt5648->jack, 0, SND_JACK_BTN_0);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Snapshot the status registers once and let rt5648_jack_work() decode
+ * them when the line has been quiet for the debounce time.  A button edge
+ * never pulls in the deadline of a plug debounce that is still pending.
+ */
+static irqreturn_t rt5648_irq(int irq, void *data)
+{
+	struct rt5648_priv *rt5648 = data;
+	struct snd_soc_codec *codec = rt5648->codec;
+	unsigned int irq_st, irq_ctrl3;
+	unsigned long now, deadline;
+	bool jd_changed;
+
+	rt5648_live_io_begin(rt5648);
+	irq_st = snd_soc_read(codec, RT5648_INT_IRQ_ST);
+	irq_ctrl3 = snd_soc_read(codec, RT5648_IRQ_CTRL3);
+	rt5648_live_io_end(rt5648);
+
+	mutex_lock(&rt5648->jd_lock);
+	rt5648->irq_st = irq_st;
+	rt5648->irq_ctrl3 = irq_ctrl3;
+	jd_changed = !(irq_st & 0x1000) != !!rt5648->jd_status;
+	now = jiffies;
+	deadline = now + msecs_to_jiffies(jd_changed ?
+		RT5648_JD_DEBOUNCE_MS : RT5648_BTN_DEBOUNCE_MS);
+	if (delayed_work_pending(&rt5648->jack_work) &&
+		time_after(rt5648->jack_deadline, deadline))
+		deadline = rt5648->jack_deadline;
+	rt5648->jack_deadline = deadline;
+	mod_delayed_work(system_power_efficient_wq, &rt5648->jack_work,
+		time_after(deadline, now) ? deadline - now : 0);
+	mutex_unlock(&rt5648->jd_lock);
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * The jack line is either the client IRQ, whose trigger firmware has
+ * already set up, or an ACPI GpioInt.  gpiod_to_irq() does not apply the
+ * GpioInt trigger, so the GPIO line asks for both edges itself: plug,
+ * unplug and button presses all toggle it.
+ */
+static int rt5648_irq_request(struct rt5648_priv *rt5648)
+{
+	struct device *dev = &rt5648->i2c->dev;
+	unsigned long flags = IRQF_ONESHOT;
+	int irq = rt5648->i2c->irq;
+	int ret;
+
+	if (irq <= 0) {
+		rt5648->jd_gpio = gpiod_get_index(dev, NULL, 0, GPIOD_IN);
+		if (IS_ERR(rt5648->jd_gpio)) {
+			ret = PTR_ERR(rt5648->jd_gpio);
+			rt5648->jd_gpio = NULL;
+			return ret;
+		}
+		irq = gpiod_to_irq(rt5648->jd_gpio);
+		if (irq < 0) {
+			ret = irq;
+			goto err_gpio;
+		}
+		flags |= IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING;
+	}
+
+	ret = request_threaded_irq(irq, NULL, rt5648_irq, flags, "rt5648",
+		rt5648);
+	if (ret < 0)
+		goto err_gpio;
+
+	rt5648->irq = irq;
+	return 0;
+
+err_gpio:
+	if (rt5648->jd_gpio) {
+		gpiod_put(rt5648->jd_gpio);
+		rt5648->jd_gpio = NULL;
+	}
+	return ret;
+}
+
+static void rt5648_irq_release(struct rt5648_priv *rt5648)
+{
+	if (!rt5648->irq)
+		return;
+
+	free_irq(rt5648->irq, rt5648);
+	rt5648->irq = 0;
+	cancel_delayed_work_sync(&rt5648->jack_work);
+	if (rt5648->jd_gpio) {
+		gpiod_put(rt5648->jd_gpio);
+		rt5648->jd_gpio = NULL;
+	}
+}
+
+/**
+ * rt5648_set_jack_detect - Let the codec driver own jack detection.
+ * @codec: SoC audio codec device.
+ * @jack: jack to report SND_JACK_HEADSET and SND_JACK_BTN_0 on, or NULL.
+ *
+ * With a jack set, rt5648_headset_detect() no longer waits for the type
+ * and the jack interrupt is taken over from the platform: plug, unplug and
+ * button events are debounced and reported on @jack.  If no interrupt is
+ * described, the platform keeps polling rt5648_check_interrupt_event().
+ */
+int rt5648_set_jack_detect(struct snd_soc_codec *codec,
+	struct snd_soc_jack *jack)
+{
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+	int ret;
+
+	if (!jack)
+		rt5648_irq_release(rt5648);
+
+	mutex_lock(&rt5648->jd_lock);
+	rt5648->jack = jack;
+	mutex_unlock(&rt5648->jd_lock);
+
+	if (!jack || rt5648->irq)
+		return 0;
+
+	ret = rt5648_irq_request(rt5648);
+	if (ret < 0) {
+		dev_dbg(codec->dev, "No jack IRQ, left to the platform: %d\n",
+			ret);
+		return 0;
+	}
+
+	/* pick up a jack plugged in before the IRQ was ours */
+	rt5648_irq(rt5648->irq, rt5648);
+
+	return 0;
+}
+EXPORT_SYMBOL(rt5648_set_jack_detect);
+
 static const DECLARE_TLV_DB_SCALE(out_vol_tlv, -4650, 150, 0);
 static const DECLARE_TLV_DB_SCALE(dac_vol_tlv, -65625, 375, 0);
 static const DECLARE_TLV_DB_SCALE(in_vol_tlv, -3450, 150, 0);
@@ -714,6 +1785,10 @@ static const struct snd_kcontrol_new rt5648_snd_controls[] = {
 	SOC_SINGLE("TDM IF1_DAC1_R Sel", RT5648_TDM_CTRL_3, 8, 7, 0),
 	SOC_SINGLE("TDM IF1_DAC2_L Sel", RT5648_TDM_CTRL_3, 4, 7, 0),
 	SOC_SINGLE("TDM IF1_DAC2_R Sel", RT5648_TDM_CTRL_3, 0, 7, 0),
+
+	/* IF3 */
+	SOC_ENUM("IF3 DAC Data Select", rt5648_if3_dac_enum),
+	SOC_ENUM("IF3 ADC Data Select", rt5648_if3_adc_enum),
 	
 	SOC_ENUM("SPOMIX GAIN CTRL", rt5648_spo_gain_ratio_enum),
 
@@ -737,6 +1812,7 @@ static const struct snd_kcontrol_new rt5648_snd_controls[] = {
  *
  * Choose dmic clock between 1MHz and 3MHz.
  * It is better for clock to approximate 3MHz.
+ * The clock is divided down from sysclk, or 256fs if that is unknown.
  */
 static int set_dmic_clk(struct snd_soc_dapm_widget *w,
 	struct snd_kcontrol *kcontrol, int event)
@@ -745,24 +1821,18 @@ static int set_dmic_clk(struct snd_soc_dapm_widget *w,
 	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
 	int div[] = {2, 3, 4, 6, 8, 12};
 	int idx = -EINVAL, i;
-	int rate, red, bound, temp;
+	int rate;
 
-	rate = rt5648->lrck[rt5648->aif_pu] << 8;
-	/* red = 3000000 * 12; */
-	red = 2000000 * 12;
+	rate = rt5648->sysclk;
+	if (rate <= 0)
+		rate = rt5648->lrck[rt5648->aif_pu] << 8;
 	for (i = 0; i < ARRAY_SIZE(div); i++) {
-		bound = div[i] * 2000000;
-		if (rate > bound)
+		if (rate / div[i] > 3000000)
 			continue;
-		temp = bound - rate;
-		if (temp < red) {
-			red = temp;
+		if (rate / div[i] >= 1000000)
 			idx = i;
-		}
+		break;
 	}
-#ifdef USE_ASRC
-	idx = 5;
-#endif
 	if (idx < 0)
 		dev_err(codec->dev, "Failed to set DMIC clock\n");
 	else
@@ -1010,6 +2080,31 @@ static const struct snd_kcontrol_new rt5648_lout_mix[] = {
 			RT5648_M_OV_R_LM_SFT, 1, 1),
 };
 
+static int rt5648_clk_plan(struct snd_soc_codec *codec, int id);
+
+/* Muxes that move an AIF onto other filters; ASRC follows them */
+static int rt5648_asrc_mux_put(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_soc_codec *codec = snd_soc_dapm_kcontrol_codec(kcontrol);
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+	int ret;
+
+	ret = snd_soc_dapm_put_enum_double(kcontrol, ucontrol);
+	if (ret <= 0)
+		return ret;
+
+	mutex_lock(&rt5648->clk_lock);
+	rt5648_clk_plan(codec, -1);
+	mutex_unlock(&rt5648->clk_lock);
+
+	return ret;
+}
+
+#define RT5648_ASRC_MUX(xname, xenum) \
+	SOC_DAPM_ENUM_EXT(xname, xenum, snd_soc_dapm_get_enum_double, \
+		rt5648_asrc_mux_put)
+
 /*DAC1 L/R source*/ /* MX-29 [9:8] [11:10] */
 static const char *rt5648_dac1_src[] = {
 	"IF1 DAC", "IF2 DAC", "IF3 DAC"
@@ -1020,14 +2115,14 @@ static const SOC_ENUM_SINGLE_DECL(
 	RT5648_DAC1_L_SEL_SFT, rt5648_dac1_src);
 
 static const struct snd_kcontrol_new rt5648_dac1l_mux =
-	SOC_DAPM_ENUM("DAC1 L source", rt5648_dac1l_enum);
+	RT5648_ASRC_MUX("DAC1 L source", rt5648_dac1l_enum);
 
 static const SOC_ENUM_SINGLE_DECL(
 	rt5648_dac1r_enum, RT5648_AD_DA_MIXER,
 	RT5648_DAC1_R_SEL_SFT, rt5648_dac1_src);
 
 static const struct snd_kcontrol_new rt5648_dac1r_mux =
-	SOC_DAPM_ENUM("DAC1 R source", rt5648_dac1r_enum);
+	RT5648_ASRC_MUX("DAC1 R source", rt5648_dac1r_enum);
 
 /*DAC2 L/R source*/ /* MX-1B [6:4] [2:0] */
 static const char *rt5648_dac12_src[] = {
@@ -1039,7 +2134,7 @@ static const SOC_ENUM_SINGLE_DECL(
 	RT5648_DAC2_L_SEL_SFT, rt5648_dac12_src);
 
 static const struct snd_kcontrol_new rt5648_dac_l2_mux =
-	SOC_DAPM_ENUM("DAC2 L source", rt5648_dac2l_enum);
+	RT5648_ASRC_MUX("DAC2 L source", rt5648_dac2l_enum);
 
 static const char *rt5648_dacr2_src[] = {
 	"IF1 DAC", "IF2 DAC", "IF3 DAC", "Mono ADC", "Haptic"
@@ -1050,7 +2145,7 @@ static const SOC_ENUM_SINGLE_DECL(
 	RT5648_DAC2_R_SEL_SFT, rt5648_dacr2_src);
 
 static const struct snd_kcontrol_new rt5648_dac_r2_mux =
-	SOC_DAPM_ENUM("DAC2 R source", rt5648_dac2r_enum);
+	RT5648_ASRC_MUX("DAC2 R source", rt5648_dac2r_enum);
 
 
 /* INL/R source */
@@ -1194,7 +2289,7 @@ static const SOC_ENUM_SINGLE_DECL(
 	RT5648_IF1_ADC_IN_SFT, rt5648_if1_adc_in_src);
 
 static const struct snd_kcontrol_new rt5648_if1_adc_in_mux =
-	SOC_DAPM_ENUM("IF1 ADC IN source", rt5648_if1_adc_in_enum);
+	RT5648_ASRC_MUX("IF1 ADC IN source", rt5648_if1_adc_in_enum);
 
 /* MX-2F [13:12] */
 static const char *rt5648_if2_adc_in_src[] = {
@@ -1206,7 +2301,7 @@ static const SOC_ENUM_SINGLE_DECL(
 	RT5648_IF2_ADC_IN_SFT, rt5648_if2_adc_in_src);
 
 static const struct snd_kcontrol_new rt5648_if2_adc_in_mux =
-	SOC_DAPM_ENUM("IF2 ADC IN source", rt5648_if2_adc_in_enum);
+	RT5648_ASRC_MUX("IF2 ADC IN source", rt5648_if2_adc_in_enum);
 
 /* MX-2F [1:0] */
 static const char *rt5648_if3_adc_in_src[] = {
@@ -1218,7 +2313,7 @@ static const SOC_ENUM_SINGLE_DECL(
 	RT5648_IF3_ADC_IN_SFT, rt5648_if3_adc_in_src);
 
 static const struct snd_kcontrol_new rt5648_if3_adc_in_mux =
-	SOC_DAPM_ENUM("IF3 ADC IN source", rt5648_if3_adc_in_enum);
+	RT5648_ASRC_MUX("IF3 ADC IN source", rt5648_if3_adc_in_enum);
 
 /* MX-31 [15] [13] [11] [9] */
 static const char *rt5648_pdm_src[] = {
@@ -1249,7 +2344,7 @@ static const SOC_ENUM_SINGLE_DECL(
 	RT5648_VAD_SEL_SFT, rt5648_vad_adc_src);
 
 static const struct snd_kcontrol_new rt5648_vad_adc_mux =
-	SOC_DAPM_ENUM("VAD ADC source", rt5648_vad_adc_enum);
+	RT5648_ASRC_MUX("VAD ADC source", rt5648_vad_adc_enum);
 
 static const struct snd_kcontrol_new spk_l_vol_control =
 	SOC_DAPM_SINGLE("Switch", RT5648_SPK_VOL,
@@ -1382,46 +2477,136 @@ static int rt5648_mono_adcr_event(struct snd_soc_dapm_widget *w,
 	return 0;
 }
 
+static void rt5648_amp_out_sync(struct snd_soc_codec *codec);
+
+/*
+ * The headphone amp needs about 150 ms of DC calibration settle after the
+ * depop parameters are set, then 5 ms between amp and charge pump power.
+ * Both waits run off rt5648_hp_amp_work so that DAPM carries on with the
+ * other widgets; the outputs behind the amp are unmuted once it is up.
+ */
+static void rt5648_hp_amp_work(struct work_struct *work)
+{
+	struct rt5648_priv *rt5648 =
+		container_of(work, struct rt5648_priv, hp_amp_work.work);
+	struct snd_soc_codec *codec = rt5648->codec;
+
+	switch (rt5648->hp_amp_state) {
+	case RT5648_HP_AMP_SETTLE:
+		/* headphone amp power on */
+		snd_soc_update_bits(codec, RT5648_PWR_ANLG1,
+			RT5648_PWR_FV1 | RT5648_PWR_FV2 , 0);
+		snd_soc_update_bits(codec, RT5648_PWR_VOL,
+			RT5648_PWR_HV_L | RT5648_PWR_HV_R,
+			RT5648_PWR_HV_L | RT5648_PWR_HV_R);
+		snd_soc_update_bits(codec, RT5648_PWR_ANLG1,
+			RT5648_PWR_HP_L | RT5648_PWR_HP_R | RT5648_PWR_HA,
+			RT5648_PWR_HP_L | RT5648_PWR_HP_R | RT5648_PWR_HA);
+		rt5648->hp_amp_state = RT5648_HP_AMP_RAMP;
+		schedule_delayed_work(&rt5648->hp_amp_work,
+			msecs_to_jiffies(5));
+		break;
+
+	case RT5648_HP_AMP_RAMP:
+		snd_soc_update_bits(codec, RT5648_PWR_ANLG1,
+			RT5648_PWR_FV1 | RT5648_PWR_FV2,
+			RT5648_PWR_FV1 | RT5648_PWR_FV2);
+		/* for TFCG-119 headset noise*/
+//		snd_soc_update_bits(codec, RT5648_HP_CALIB_AMP_DET,
+//			RT5648_HPD_PS_MASK, RT5648_HPD_PS_EN);
+		/* for TFCG-119 headset noise*/
+		snd_soc_update_bits(codec, RT5648_DEPOP_M1,
+			RT5648_HP_CO_MASK | RT5648_HP_SG_MASK,
+			RT5648_HP_CO_EN | RT5648_HP_SG_EN);
+
+		rt5648_index_write(codec, 0x14, 0x1aaa);
+		rt5648_index_write(codec, 0x24, 0x0430);
+		mutex_lock(&rt5648->hp_lock);
+		rt5648->hp_amp_state = RT5648_HP_AMP_ON;
+		rt5648_amp_out_sync(codec);
+		mutex_unlock(&rt5648->hp_lock);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/*
+ * Power steps that only need time to pass before the next step of the
+ * same path record a deadline instead of sleeping, so that DAPM runs the
+ * other paths' events in the meantime.  The next step of the path sleeps
+ * off whatever is left.
+ */
+static void rt5648_settle(ktime_t *deadline)
+{
+	s64 us = ktime_us_delta(*deadline, ktime_get());
+
+	if (us > 0)
+		usleep_range(us, us + 1000);
+	*deadline = ktime_set(0, 0);
+}
+
+/* End of the headphone unmute ramp started in rt5648_pmu_depop() */
+static void rt5648_hp_depop_work(struct work_struct *work)
+{
+	struct rt5648_priv *rt5648 =
+		container_of(work, struct rt5648_priv, hp_depop_work.work);
+
+	snd_soc_update_bits(rt5648->codec, RT5648_DEPOP_M1,
+		RT5648_HP_SG_MASK | RT5648_HP_L_SMT_MASK |
+		RT5648_HP_R_SMT_MASK, RT5648_HP_SG_DIS |
+		RT5648_HP_L_SMT_DIS | RT5648_HP_R_SMT_DIS);
+}
+
+/*
+ * Stop the amp and depop works before the maps go cache-only, or their
+ * writes would only land in the cache.  An amp caught half way up is
+ * left off with its outputs muted.
+ */
+static void rt5648_hp_works_cancel(struct rt5648_priv *rt5648)
+{
+	cancel_delayed_work_sync(&rt5648->hp_depop_work);
+	cancel_delayed_work_sync(&rt5648->hp_amp_work);
+
+	mutex_lock(&rt5648->hp_lock);
+	if (rt5648->hp_amp_state != RT5648_HP_AMP_ON &&
+		rt5648->hp_amp_state != RT5648_HP_AMP_OFF) {
+		rt5648->hp_amp_state = RT5648_HP_AMP_OFF;
+		rt5648_amp_out_sync(rt5648->codec);
+	}
+	mutex_unlock(&rt5648->hp_lock);
+}
+
 static void hp_amp_power(struct snd_soc_codec *codec, int on)
 {
-	static int hp_amp_power_count;
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
 
 	if(on) {
-		if(hp_amp_power_count <= 0) {
+		if(rt5648->hp_amp_count <= 0) {
 			/* depop parameters */
 			snd_soc_update_bits(codec, RT5648_DEPOP_M2,
 				RT5648_DEPOP_MASK, RT5648_DEPOP_MAN);
-			snd_soc_write(codec, RT5648_DEPOP_M1, 0x000d);
+			snd_soc_update_bits(codec, RT5648_DEPOP_M1, 0xffff,
+				0x000d);
 			rt5648_index_write(codec, RT5648_HP_DCC_INT1, 0x9f01);
-			mdelay(150);
-			/* headphone amp power on */
-			snd_soc_update_bits(codec, RT5648_PWR_ANLG1,
-				RT5648_PWR_FV1 | RT5648_PWR_FV2 , 0);
-			snd_soc_update_bits(codec, RT5648_PWR_VOL,
-				RT5648_PWR_HV_L | RT5648_PWR_HV_R,
-				RT5648_PWR_HV_L | RT5648_PWR_HV_R);
-			snd_soc_update_bits(codec, RT5648_PWR_ANLG1,
-				RT5648_PWR_HP_L | RT5648_PWR_HP_R | RT5648_PWR_HA,
-				RT5648_PWR_HP_L | RT5648_PWR_HP_R | RT5648_PWR_HA);
-			msleep(5);
-			snd_soc_update_bits(codec, RT5648_PWR_ANLG1,
-				RT5648_PWR_FV1 | RT5648_PWR_FV2,
-				RT5648_PWR_FV1 | RT5648_PWR_FV2);
-			/* for TFCG-119 headset noise*/
-//			snd_soc_update_bits(codec, RT5648_HP_CALIB_AMP_DET,
-//				RT5648_HPD_PS_MASK, RT5648_HPD_PS_EN);
-			/* for TFCG-119 headset noise*/
-			snd_soc_update_bits(codec, RT5648_DEPOP_M1,
-				RT5648_HP_CO_MASK | RT5648_HP_SG_MASK,
-				RT5648_HP_CO_EN | RT5648_HP_SG_EN);
-
-			rt5648_index_write(codec, 0x14, 0x1aaa);
-			rt5648_index_write(codec, 0x24, 0x0430);
+			mutex_lock(&rt5648->hp_lock);
+			rt5648->hp_amp_state = RT5648_HP_AMP_SETTLE;
+			mutex_unlock(&rt5648->hp_lock);
+			schedule_delayed_work(&rt5648->hp_amp_work,
+				msecs_to_jiffies(150));
 		}
-		hp_amp_power_count++;
+		rt5648->hp_amp_count++;
 	} else {
-		hp_amp_power_count--;
-		if(hp_amp_power_count <= 0) {
+		rt5648->hp_amp_count--;
+		if(rt5648->hp_amp_count <= 0) {
+			cancel_delayed_work_sync(&rt5648->hp_amp_work);
+			mutex_lock(&rt5648->hp_lock);
+			rt5648->hp_amp_state = RT5648_HP_AMP_OFF;
+			rt5648_amp_out_sync(codec);
+			mutex_unlock(&rt5648->hp_lock);
+			/* let the mute ramp of rt5648_pmd_depop() finish */
+			rt5648_settle(&rt5648->hp_pmd_settle);
 			snd_soc_update_bits(codec, RT5648_DEPOP_M1,
 				RT5648_HP_SG_MASK | RT5648_HP_L_SMT_MASK |
 				RT5648_HP_R_SMT_MASK, RT5648_HP_SG_DIS |
@@ -1436,7 +2621,8 @@ static void hp_amp_power(struct snd_soc_codec *codec, int on)
 				RT5648_HP_CO_DIS | RT5648_HP_CP_PD |
 				RT5648_HP_SG_EN | RT5648_HP_CB_PD);
 			*/
-			snd_soc_write(codec, RT5648_DEPOP_M1, 0x0000);
+			snd_soc_update_bits(codec, RT5648_DEPOP_M1, 0xffff,
+				0x0000);
 			snd_soc_update_bits(codec, RT5648_PWR_ANLG1,
 				RT5648_PWR_HP_L | RT5648_PWR_HP_R | RT5648_PWR_HA,
 				0);
@@ -1446,6 +2632,8 @@ static void hp_amp_power(struct snd_soc_codec *codec, int on)
 
 static void rt5648_pmu_depop(struct snd_soc_codec *codec)
 {
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+
 	//hp_amp_power(codec, 1);
 	/* headphone unmute sequence */
 	snd_soc_update_bits(codec, RT5648_DEPOP_M3,
@@ -1463,16 +2651,15 @@ static void rt5648_pmu_depop(struct snd_soc_codec *codec)
 		RT5648_RSTN_DIS | RT5648_HP_L_SMT_EN | RT5648_HP_R_SMT_EN);
 	snd_soc_update_bits(codec, RT5648_HP_VOL,
 		RT5648_L_MUTE | RT5648_R_MUTE, 0);
-	msleep(40);
-	snd_soc_update_bits(codec, RT5648_DEPOP_M1,
-		RT5648_HP_SG_MASK | RT5648_HP_L_SMT_MASK |
-		RT5648_HP_R_SMT_MASK, RT5648_HP_SG_DIS |
-		RT5648_HP_L_SMT_DIS | RT5648_HP_R_SMT_DIS);
-
+	/* nothing else waits on the 40 ms soft ramp */
+	schedule_delayed_work(&rt5648->hp_depop_work, msecs_to_jiffies(40));
 }
 
 static void rt5648_pmd_depop(struct snd_soc_codec *codec)
 {
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+
+	cancel_delayed_work_sync(&rt5648->hp_depop_work);
 	/* headphone mute sequence */
 	snd_soc_update_bits(codec, RT5648_DEPOP_M3,
 		RT5648_CP_FQ1_MASK | RT5648_CP_FQ2_MASK | RT5648_CP_FQ3_MASK,
@@ -1491,11 +2678,64 @@ static void rt5648_pmd_depop(struct snd_soc_codec *codec)
 
 	snd_soc_update_bits(codec, RT5648_HP_VOL,
 		RT5648_L_MUTE | RT5648_R_MUTE, RT5648_L_MUTE | RT5648_R_MUTE);
-	msleep(30);
+	rt5648->hp_pmd_settle = ktime_add_ms(ktime_get(), 30);
 
 	//hp_amp_power(codec, 0);
 }
 
+/*
+ * Bring the outputs behind "HP amp Power" in line with what DAPM asked
+ * for, as far as the amp state allows.  Caller holds hp_lock.
+ */
+static void rt5648_amp_out_sync(struct snd_soc_codec *codec)
+{
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+	unsigned int on, up, down;
+
+	on = rt5648->hp_amp_state == RT5648_HP_AMP_ON ?
+		rt5648->amp_out_want : 0;
+	up = on & ~rt5648->amp_out_on;
+	down = rt5648->amp_out_on & ~on;
+
+	if (down & RT5648_AMP_OUT_HP)
+		rt5648_pmd_depop(codec);
+	if (down & RT5648_AMP_OUT_LOUT) {
+		snd_soc_update_bits(codec, RT5648_LOUT1,
+			RT5648_L_MUTE | RT5648_R_MUTE,
+			RT5648_L_MUTE | RT5648_R_MUTE);
+		snd_soc_update_bits(codec, RT5648_PWR_ANLG1,
+			RT5648_PWR_LM, 0);
+	}
+	if (up & RT5648_AMP_OUT_HP)
+		rt5648_pmu_depop(codec);
+	if (up & RT5648_AMP_OUT_LOUT) {
+		snd_soc_update_bits(codec, RT5648_PWR_ANLG1,
+			RT5648_PWR_LM, RT5648_PWR_LM);
+		snd_soc_update_bits(codec, RT5648_LOUT1,
+			RT5648_L_MUTE | RT5648_R_MUTE, 0);
+	}
+	rt5648->amp_out_on = on;
+}
+
+/*
+ * The HP and line outputs do not wait for the amp in their DAPM events:
+ * an output powered up early is unmuted by rt5648_hp_amp_work, so the
+ * speaker and the rest of the route come up in the meantime.
+ */
+static void rt5648_amp_out_set(struct snd_soc_codec *codec,
+	unsigned int out, bool on)
+{
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+
+	mutex_lock(&rt5648->hp_lock);
+	if (on)
+		rt5648->amp_out_want |= out;
+	else
+		rt5648->amp_out_want &= ~out;
+	rt5648_amp_out_sync(codec);
+	mutex_unlock(&rt5648->hp_lock);
+}
+
 static int rt5648_hp_event(struct snd_soc_dapm_widget *w,
 	struct snd_kcontrol *kcontrol, int event)
 {
@@ -1503,11 +2743,11 @@ static int rt5648_hp_event(struct snd_soc_dapm_widget *w,
 
 	switch (event) {
 	case SND_SOC_DAPM_POST_PMU:
-		rt5648_pmu_depop(codec);
+		rt5648_amp_out_set(codec, RT5648_AMP_OUT_HP, true);
 		break;
 
 	case SND_SOC_DAPM_PRE_PMD:
-		rt5648_pmd_depop(codec);
+		rt5648_amp_out_set(codec, RT5648_AMP_OUT_HP, false);
 		break;
 
 	default:
@@ -1517,6 +2757,9 @@ static int rt5648_hp_event(struct snd_soc_dapm_widget *w,
 	return 0;
 }
 
+static const unsigned int spk_pr_reg[] = { 0x1c, 0x20, 0x21, 0x23 };
+static const unsigned int spk_pr_val[] = { 0xfd20, 0x611f, 0x4040, 0x0004 };
+
 static int rt5648_spk_event(struct snd_soc_dapm_widget *w,
 	struct snd_kcontrol *kcontrol, int event)
 {
@@ -1524,10 +2767,8 @@ static int rt5648_spk_event(struct snd_soc_dapm_widget *w,
 	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
 	switch (event) {
 	case SND_SOC_DAPM_POST_PMU:
-		rt5648_index_write(codec, 0x1c, 0xfd20);
-		rt5648_index_write(codec, 0x20, 0x611f);
-		rt5648_index_write(codec, 0x21, 0x4040);
-		rt5648_index_write(codec, 0x23, 0x0004);
+		rt5648_index_bulk_write(codec, spk_pr_reg, spk_pr_val,
+			ARRAY_SIZE(spk_pr_reg));
 
 		snd_soc_update_bits(codec, RT5648_PWR_DIG1,
 			RT5648_PWR_CLS_D | RT5648_PWR_CLS_D_R | RT5648_PWR_CLS_D_L,
@@ -1603,18 +2844,11 @@ static int rt5648_lout_event(struct snd_soc_dapm_widget *w,
 	switch (event) {
 	case SND_SOC_DAPM_POST_PMU:
 //		hp_amp_power(codec,1);
-		snd_soc_update_bits(codec, RT5648_PWR_ANLG1,
-			RT5648_PWR_LM, RT5648_PWR_LM);
-		snd_soc_update_bits(codec, RT5648_LOUT1,
-			RT5648_L_MUTE | RT5648_R_MUTE, 0);
+		rt5648_amp_out_set(codec, RT5648_AMP_OUT_LOUT, true);
 		break;
 
 	case SND_SOC_DAPM_PRE_PMD:
-		snd_soc_update_bits(codec, RT5648_LOUT1,
-			RT5648_L_MUTE | RT5648_R_MUTE,
-			RT5648_L_MUTE | RT5648_R_MUTE);
-		snd_soc_update_bits(codec, RT5648_PWR_ANLG1,
-			RT5648_PWR_LM, 0);
+		rt5648_amp_out_set(codec, RT5648_AMP_OUT_LOUT, false);
 //		hp_amp_power(codec,0);
 		break;
 
@@ -1656,13 +2890,14 @@ static int rt5648_bst1_event(struct snd_soc_dapm_widget *w,
 	switch (event) {
 	case SND_SOC_DAPM_POST_PMU:
 		/* tf103cg FOR MIC agc function*/
-		snd_soc_write(codec, RT5648_ALC_DRC_CTRL2, 0x0023);
-		snd_soc_write(codec, RT5648_ALC_CTRL_1, 0xC206);
-		snd_soc_write(codec, RT5648_ALC_CTRL_2, 0x63E1);
-		snd_soc_write(codec, RT5648_ALC_CTRL_3, 0x0011);
-		snd_soc_write(codec, RT5648_ALC_CTRL_4, 0x2263);
-		snd_soc_write(codec, RT5648_ADJ_HPF1, 0xA220);
-		snd_soc_write(codec, RT5648_ADJ_HPF2, 0x0101);
+		snd_soc_update_bits(codec, RT5648_ALC_DRC_CTRL2, 0xffff,
+			0x0023);
+		snd_soc_update_bits(codec, RT5648_ALC_CTRL_1, 0xffff, 0xC206);
+		snd_soc_update_bits(codec, RT5648_ALC_CTRL_2, 0xffff, 0x63E1);
+		snd_soc_update_bits(codec, RT5648_ALC_CTRL_3, 0xffff, 0x0011);
+		snd_soc_update_bits(codec, RT5648_ALC_CTRL_4, 0xffff, 0x2263);
+		snd_soc_update_bits(codec, RT5648_ADJ_HPF1, 0xffff, 0xA220);
+		snd_soc_update_bits(codec, RT5648_ADJ_HPF2, 0xffff, 0x0101);
 		/* tf103cg FOR MIC agc function*/
 		//gpio_direction_output(gpio_3v,1);//work around for power when play music in idle mode
 		break;
@@ -1685,13 +2920,14 @@ static int rt5648_bst2_event(struct snd_soc_dapm_widget *w,
 		snd_soc_update_bits(codec, RT5648_PWR_ANLG2,
 			RT5648_PWR_BST2_P, RT5648_PWR_BST2_P);
 		/* tf103cg FOR MIC agc function*/
-		snd_soc_write(codec, RT5648_ALC_DRC_CTRL2,0x00BF);
-		snd_soc_write(codec, RT5648_ALC_CTRL_1, 0xC207);
-		snd_soc_write(codec, RT5648_ALC_CTRL_2, 0x7FE1);
-		snd_soc_write(codec, RT5648_ALC_CTRL_3, 0x0013);
-		snd_soc_write(codec, RT5648_ALC_CTRL_4, 0x6324);
-		snd_soc_write(codec, RT5648_ADJ_HPF1, 0xA220);
-		snd_soc_write(codec, RT5648_ADJ_HPF2, 0x0303);
+		snd_soc_update_bits(codec, RT5648_ALC_DRC_CTRL2, 0xffff,
+			0x00BF);
+		snd_soc_update_bits(codec, RT5648_ALC_CTRL_1, 0xffff, 0xC207);
+		snd_soc_update_bits(codec, RT5648_ALC_CTRL_2, 0xffff, 0x7FE1);
+		snd_soc_update_bits(codec, RT5648_ALC_CTRL_3, 0xffff, 0x0013);
+		snd_soc_update_bits(codec, RT5648_ALC_CTRL_4, 0xffff, 0x6324);
+		snd_soc_update_bits(codec, RT5648_ADJ_HPF1, 0xffff, 0xA220);
+		snd_soc_update_bits(codec, RT5648_ADJ_HPF2, 0xffff, 0x0303);
 		/* tf103cg FOR MIC agc function*/
 		//gpio_direction_output(gpio_3v,1);//work around for power when play music in idle mode
 		break;
@@ -1845,16 +3081,6 @@ static int rt5648_hpvol_r_event(struct snd_soc_dapm_widget *w,
 static int rt5648_post_event(struct snd_soc_dapm_widget *w,
 	struct snd_kcontrol *kcontrol, int event)
 {
-#ifdef USE_ASRC
-	switch (event) {
-	case SND_SOC_DAPM_POST_PMU:
-//		snd_soc_write(codec, RT5648_ASRC_1, 0xffff);
-//		snd_soc_write(codec, RT5648_ASRC_2, 0x1221);
-		break;
-	default:
-		return 0;
-	}
-#endif
 	return 0;
 }
 
@@ -1865,10 +3091,6 @@ static int rt5648_pre_event(struct snd_soc_dapm_widget *w,
 
 	switch (event) {
 	case SND_SOC_DAPM_PRE_PMD:
-#ifdef USE_ASRC
-//		snd_soc_write(codec, RT5648_ASRC_1, 0x0);
-//		snd_soc_write(codec, RT5648_ASRC_2, 0x0);
-#endif
 		break;
 	case SND_SOC_DAPM_PRE_PMU:
 		snd_soc_update_bits(codec, RT5648_PWR_ANLG1, RT5648_LDO_SEL_MASK, 0x2);
@@ -1879,19 +3101,120 @@ static int rt5648_pre_event(struct snd_soc_dapm_widget *w,
 	return 0;
 }
 
+#define RT5648_SEL(val, name) \
+	(((val) & RT5648_##name##_MASK) >> RT5648_##name##_SFT)
+
+/* Filter behind an IF_ADC2 or VAD_ADC selection */
+static unsigned int rt5648_asrc_adc_filter(struct snd_soc_codec *codec,
+	unsigned int sel)
+{
+	switch (sel) {
+	case 0: /* IF_ADC1 */
+		return RT5648_ADC_M_ASYN;
+	case 1: /* IF_ADC2 */
+		return RT5648_MAD_L_M_ASYN | RT5648_MAD_R_M_ASYN;
+	case 2: /* VAD_ADC */
+		switch (RT5648_SEL(snd_soc_read(codec, RT5648_VAD_CTRL4),
+			VAD_SEL)) {
+		case 0:
+			return RT5648_ADC_M_ASYN;
+		case 1:
+			return RT5648_MAD_L_M_ASYN;
+		default:
+			return RT5648_MAD_R_M_ASYN;
+		}
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Filters carrying a stream of AIF @id, as the muxes route it now.  DAC1
+ * L/R feed the stereo DAC filter and DAC2 L/R the mono DAC ones; each
+ * takes IF1, IF2 or IF3.  On capture IFn ADC IN picks the stereo ADC
+ * (IF_ADC1) or the mono ADC (IF_ADC2).  Called with clk_lock held.
+ */
+static unsigned int rt5648_asrc_filter(struct snd_soc_codec *codec, int id,
+	int stream)
+{
+	unsigned int val, mask = 0;
+
+	if (stream == SNDRV_PCM_STREAM_PLAYBACK) {
+		val = snd_soc_read(codec, RT5648_AD_DA_MIXER);
+		if (RT5648_SEL(val, DAC1_L_SEL) == id ||
+			RT5648_SEL(val, DAC1_R_SEL) == id)
+			mask |= RT5648_STO_DAC_M_ASYN;
+		val = snd_soc_read(codec, RT5648_DAC_CTRL);
+		if (RT5648_SEL(val, DAC2_L_SEL) == id)
+			mask |= RT5648_MDA_L_M_ASYN;
+		if (RT5648_SEL(val, DAC2_R_SEL) == id)
+			mask |= RT5648_MDA_R_M_ASYN;
+		return mask;
+	}
+
+	switch (id) {
+	case RT5648_AIF1:
+		val = RT5648_SEL(snd_soc_read(codec, RT5648_TDM_CTRL_1),
+			IF1_ADC_IN);
+		break;
+	case RT5648_AIF2:
+		val = RT5648_SEL(snd_soc_read(codec, RT5648_DIG_INF1_DATA),
+			IF2_ADC_IN);
+		break;
+	case RT5648_AIF3:
+		val = RT5648_SEL(snd_soc_read(codec, RT5648_DIG_INF1_DATA),
+			IF3_ADC_IN);
+		break;
+	default:
+		return 0;
+	}
+
+	return rt5648_asrc_adc_filter(codec, val);
+}
+
+#define RT5648_ASRC_ADC_FILTERS		(RT5648_ADC_M_ASYN | \
+	RT5648_MAD_L_M_ASYN | RT5648_MAD_R_M_ASYN)
+
+/* Rest of the vendor ASRC setting, needed whenever a filter uses ASRC */
+#define RT5648_ASRC1_CLK		(0xffff & \
+	~(RT5648_DMIC_1_M_MASK | RT5648_DMIC_2_M_MASK))
+#define RT5648_ASRC2_CLK		(0x0200 | RT5648_PRE_SCLK_1024)
+
+/* Called with clk_lock held */
+static void rt5648_asrc_apply(struct snd_soc_codec *codec)
+{
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+	unsigned int mask = rt5648->asrc_on ? rt5648->asrc_mask : 0;
+	unsigned int asrc1 = 0, asrc2 = 0;
+
+	if (mask) {
+		asrc1 = RT5648_ASRC1_CLK;
+		if (mask & RT5648_ASRC_ADC_FILTERS)
+			asrc1 |= RT5648_DMIC_1_M_ASYN | RT5648_DMIC_2_M_ASYN;
+		asrc2 = RT5648_ASRC2_CLK | mask;
+	}
+	snd_soc_update_bits(codec, RT5648_ASRC_1, 0xffff, asrc1);
+	snd_soc_update_bits(codec, RT5648_ASRC_2, 0xffff, asrc2);
+}
+
 static int rt5648_asrc_event(struct snd_soc_dapm_widget *w,
 	struct snd_kcontrol *kcontrol, int event)
 {
 	struct snd_soc_codec *codec = snd_soc_dapm_to_codec(w->dapm);
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
 
 	switch (event) {
 	case SND_SOC_DAPM_PRE_PMD:
-		snd_soc_write(codec, RT5648_ASRC_1, 0x0);
-		snd_soc_write(codec, RT5648_ASRC_2, 0x0);
+		mutex_lock(&rt5648->clk_lock);
+		rt5648->asrc_on = false;
+		rt5648_asrc_apply(codec);
+		mutex_unlock(&rt5648->clk_lock);
 		break;
 	case SND_SOC_DAPM_POST_PMU:
-		snd_soc_write(codec, RT5648_ASRC_1, 0xffff);
-		snd_soc_write(codec, RT5648_ASRC_2, 0x1221);
+		mutex_lock(&rt5648->clk_lock);
+		rt5648->asrc_on = true;
+		rt5648_asrc_apply(codec);
+		mutex_unlock(&rt5648->clk_lock);
 		break;
 	default:
 		return 0;
@@ -1903,17 +3226,20 @@ static int rt5648_record_event(struct snd_soc_dapm_widget *w,
 	struct snd_kcontrol *kcontrol, int event)
 {
 	struct snd_soc_codec *codec = snd_soc_dapm_to_codec(w->dapm);
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
 	//int gpio_3v;
 	//gpio_3v = get_gpio_by_name("P_+3VSO_SYNC_5");//work around for power when play music in idle mode
 	switch (event) {
 	case SND_SOC_DAPM_POST_PMU:
 		is_recording = 1;
+		rt5648_update_eqmode(codec, EQ_CH_ADC, rt5648->adc_eq_mode);
 		break;
 
 	case SND_SOC_DAPM_PRE_PMD:
 		is_recording = 0;
-		snd_soc_write(codec, RT5648_ADJ_HPF1, 0xB320);
-		snd_soc_write(codec, RT5648_ADJ_HPF2, 0x0000);
+		rt5648_update_eqmode(codec, EQ_CH_ADC, NORMAL);
+		snd_soc_update_bits(codec, RT5648_ADJ_HPF1, 0xffff, 0xB320);
+		snd_soc_update_bits(codec, RT5648_ADJ_HPF2, 0xffff, 0x0000);
 		snd_soc_update_bits(codec, RT5648_ALC_CTRL_1, RT5648_DRC_AGC_MASK, RT5648_DRC_AGC_DIS);
 		//gpio_direction_output(gpio_3v,0);//work around for power when play music in idle mode
 		break;
@@ -2096,6 +3422,12 @@ static const struct snd_soc_dapm_widget rt5648_dapm_widgets[] = {
 	SND_SOC_DAPM_PGA("IF2 DAC L", SND_SOC_NOPM, 0, 0, NULL, 0),
 	SND_SOC_DAPM_PGA("IF2 DAC R", SND_SOC_NOPM, 0, 0, NULL, 0),
 	SND_SOC_DAPM_PGA("IF2 ADC", SND_SOC_NOPM, 0, 0, NULL, 0),
+	SND_SOC_DAPM_SUPPLY("I2S3", RT5648_PWR_DIG1,
+		RT5648_PWR_I2S3_BIT, 0, NULL, 0),
+	SND_SOC_DAPM_PGA("IF3 DAC", SND_SOC_NOPM, 0, 0, NULL, 0),
+	SND_SOC_DAPM_PGA("IF3 DAC L", SND_SOC_NOPM, 0, 0, NULL, 0),
+	SND_SOC_DAPM_PGA("IF3 DAC R", SND_SOC_NOPM, 0, 0, NULL, 0),
+	SND_SOC_DAPM_PGA("IF3 ADC", SND_SOC_NOPM, 0, 0, NULL, 0),
 
 	/* Digital Interface Select */
 	SND_SOC_DAPM_MUX("VAD ADC Mux", SND_SOC_NOPM,
@@ -2106,6 +3438,8 @@ static const struct snd_soc_dapm_widget rt5648_dapm_widgets[] = {
 	SND_SOC_DAPM_AIF_OUT("AIF1TX", "AIF1 Capture", 0, SND_SOC_NOPM, 0, 0),
 	SND_SOC_DAPM_AIF_IN("AIF2RX", "AIF2 Playback", 0, SND_SOC_NOPM, 0, 0),
 	SND_SOC_DAPM_AIF_OUT("AIF2TX", "AIF2 Capture", 0, SND_SOC_NOPM, 0, 0),
+	SND_SOC_DAPM_AIF_IN("AIF3RX", "AIF3 Playback", 0, SND_SOC_NOPM, 0, 0),
+	SND_SOC_DAPM_AIF_OUT("AIF3TX", "AIF3 Capture", 0, SND_SOC_NOPM, 0, 0),
 
 	/* Audio DSP */
 	SND_SOC_DAPM_PGA("Audio DSP", SND_SOC_NOPM, 0, 0, NULL, 0),
@@ -2375,25 +3709,35 @@ static const struct snd_soc_dapm_route rt5648_dapm_routes[] = {
 	{ "IF2 ADC Mux", "IF_ADC2", "IF_ADC2" },
 	{ "IF2 ADC Mux", "VAD_ADC", "VAD_ADC" },
 
+	{ "IF3 ADC Mux", "IF_ADC1", "IF_ADC1" },
+	{ "IF3 ADC Mux", "IF_ADC2", "IF_ADC2" },
+	{ "IF3 ADC Mux", "VAD_ADC", "VAD_ADC" },
+
 	{ "IF1 ADC", NULL, "I2S1" },
 	{ "IF1 ADC", NULL, "IF1 ADC Mux" },
 	{ "IF2 ADC", NULL, "I2S2" },
 	{ "IF2 ADC", NULL, "IF2 ADC Mux" },
+	{ "IF3 ADC", NULL, "I2S3" },
+	{ "IF3 ADC", NULL, "IF3 ADC Mux" },
 
 	{ "I2S1", NULL, "ASRC" },
 	{ "I2S2", NULL, "ASRC" },
+	{ "I2S3", NULL, "ASRC" },
 	
 	{ "AIF1TX", NULL, "IF1 ADC" },
 	{ "AIF2TX", NULL, "IF2 ADC" },
+	{ "AIF3TX", NULL, "IF3 ADC" },
 
 	{ "IF1 DAC1", NULL, "AIF1RX" },
 	{ "IF1 DAC2", NULL, "AIF1RX" },
 
 	{ "IF2 DAC", NULL, "AIF2RX" },
+	{ "IF3 DAC", NULL, "AIF3RX" },
 	
 	{ "IF1 DAC1", NULL, "I2S1" },
 	{ "IF1 DAC2", NULL, "I2S1" },
 	{ "IF2 DAC", NULL, "I2S2" },
+	{ "IF3 DAC", NULL, "I2S3" },
 
 	{ "IF1 DAC2 L", NULL, "IF1 DAC2" },
 	{ "IF1 DAC2 R", NULL, "IF1 DAC2" },
@@ -2401,12 +3745,16 @@ static const struct snd_soc_dapm_route rt5648_dapm_routes[] = {
 	{ "IF1 DAC1 R", NULL, "IF1 DAC1" },
 	{ "IF2 DAC L", NULL, "IF2 DAC" },
 	{ "IF2 DAC R", NULL, "IF2 DAC" },
+	{ "IF3 DAC L", NULL, "IF3 DAC" },
+	{ "IF3 DAC R", NULL, "IF3 DAC" },
 
 	{ "DAC1 L Mux", "IF1 DAC", "IF1 DAC1 L" },
 	{ "DAC1 L Mux", "IF2 DAC", "IF2 DAC L" },
+	{ "DAC1 L Mux", "IF3 DAC", "IF3 DAC L" },
 
 	{ "DAC1 R Mux", "IF1 DAC", "IF1 DAC1 R" },
 	{ "DAC1 R Mux", "IF2 DAC", "IF2 DAC R" },
+	{ "DAC1 R Mux", "IF3 DAC", "IF3 DAC R" },
 
 	{ "DAC1 MIXL", "Stereo ADC Switch", "Stereo1 ADC MIXL" },
 	{ "DAC1 MIXL", "DAC1 Switch", "DAC1 L Mux" },
@@ -2423,6 +3771,7 @@ static const struct snd_soc_dapm_route rt5648_dapm_routes[] = {
 
 	{ "DAC L2 Mux", "IF1 DAC", "IF1 DAC2 L" },
 	{ "DAC L2 Mux", "IF2 DAC", "IF2 DAC L" },
+	{ "DAC L2 Mux", "IF3 DAC", "IF3 DAC L" },
 	{ "DAC L2 Mux", "Mono ADC", "Mono ADC MIXL" },
 	{ "DAC L2 Mux", "VAD_ADC", "VAD_ADC" },
 	{ "DAC L2 Volume", NULL, "DAC L2 Mux" },
@@ -2430,6 +3779,7 @@ static const struct snd_soc_dapm_route rt5648_dapm_routes[] = {
 
 	{ "DAC R2 Mux", "IF1 DAC", "IF1 DAC2 R" },
 	{ "DAC R2 Mux", "IF2 DAC", "IF2 DAC R" },
+	{ "DAC R2 Mux", "IF3 DAC", "IF3 DAC R" },
 	{ "DAC R2 Mux", "Mono ADC", "Mono ADC MIXR" },
 	{ "DAC R2 Mux", "Haptic", "Haptic Generator" },
 	{ "DAC R2 Volume", NULL, "DAC R2 Mux" },
@@ -2554,13 +3904,23 @@ static const struct snd_soc_dapm_route rt5648_dapm_routes[] = {
 	{ "SPOR", NULL, "SPK amp" },
 };
 
+/*
+ * GEN_CTRL3 bit 1 is kept set while AIF2 is idle, as rt5648_reg_init()
+ * leaves it, and cleared while any AIF2 stream is set up.  Called with
+ * clk_lock held.
+ */
+static void rt5648_aif2_gate(struct snd_soc_codec *codec)
+{
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+
+	snd_soc_update_bits(codec, RT5648_GEN_CTRL3, 0x2,
+		rt5648->aif_active & RT5648_AIF_STREAMS(RT5648_AIF2) ? 0 : 0x2);
+}
+
 static int get_clk_info(int sclk, int rate)
 {
 	int i, pd[] = {1, 2, 3, 4, 6, 8, 12, 16};
 
-#ifdef USE_ASRC
-	return 0;
-#endif
 	if (sclk <= 0 || rate <= 0)
 		return -EINVAL;
 
@@ -2578,31 +3938,17 @@ static int rt5648_hw_params(struct snd_pcm_substream *substream,
 	struct snd_soc_pcm_runtime *rtd = substream->private_data;
 	struct snd_soc_codec *codec = rtd->codec;
 	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
-	unsigned int val_len = 0, val_clk, mask_clk;
-	int pre_div, bclk_ms, frame_size;
-
-  if (RT5648_AIF2 == dai->id)
-    snd_soc_update_bits(codec, RT5648_GEN_CTRL3, 0x2, 0);
+	unsigned int val_len = 0, val_clk, mask_clk, reg_sdp;
+	int ret, bclk_ms, frame_size;
 
-	rt5648->lrck[dai->id] = params_rate(params);
-	pre_div = get_clk_info(rt5648->sysclk, rt5648->lrck[dai->id]);
-	if (pre_div < 0) {
-		dev_err(codec->dev, "Unsupported clock setting\n");
-		return -EINVAL;
-	}
 	frame_size = snd_soc_params_to_frame_size(params);
 	if (frame_size < 0) {
 		dev_err(codec->dev, "Unsupported frame size: %d\n", frame_size);
 		return -EINVAL;
 	}
 	bclk_ms = frame_size > 32 ? 1 : 0;
-	rt5648->bclk[dai->id] = rt5648->lrck[dai->id] * (32 << bclk_ms);
-
-	dev_dbg(dai->dev, "bclk is %dHz and lrck is %dHz\n",
-		rt5648->bclk[dai->id], rt5648->lrck[dai->id]);
-	dev_dbg(dai->dev, "bclk_ms is %d and pre_div is %d for iis %d\n",
-				bclk_ms, pre_div, dai->id);
 
+	/* reject what cannot be set before the stream counts as active */
 	switch (params_format(params)) {
 	case SNDRV_PCM_FORMAT_S16_LE:
 		break;
@@ -2620,39 +3966,87 @@ static int rt5648_hw_params(struct snd_pcm_substream *substream,
 	}
 	switch (dai->id) {
 	case RT5648_AIF1:
- 		mask_clk = RT5648_I2S_BCLK_MS1_MASK | RT5648_I2S_PD1_MASK;
-		val_clk = bclk_ms << RT5648_I2S_BCLK_MS1_SFT |
-			pre_div << RT5648_I2S_PD1_SFT;
-		snd_soc_update_bits(codec, RT5648_I2S1_SDP,
-			RT5648_I2S_DL_MASK, val_len);
-		snd_soc_update_bits(codec, RT5648_ADDA_CLK1, mask_clk, val_clk);
+		reg_sdp = RT5648_I2S1_SDP;
+		mask_clk = RT5648_I2S_BCLK_MS1_MASK;
+		val_clk = bclk_ms << RT5648_I2S_BCLK_MS1_SFT;
 		break;
 	case  RT5648_AIF2:
-		mask_clk = RT5648_I2S_BCLK_MS2_MASK | RT5648_I2S_PD2_MASK;
-		val_clk = bclk_ms << RT5648_I2S_BCLK_MS2_SFT |
-			pre_div << RT5648_I2S_PD2_SFT;
-		snd_soc_update_bits(codec, RT5648_I2S2_SDP,
-			RT5648_I2S_DL_MASK, val_len);
-		snd_soc_update_bits(codec, RT5648_ADDA_CLK1, mask_clk, val_clk);
+		reg_sdp = RT5648_I2S2_SDP;
+		mask_clk = RT5648_I2S_BCLK_MS2_MASK;
+		val_clk = bclk_ms << RT5648_I2S_BCLK_MS2_SFT;
+		break;
+	case RT5648_AIF3:
+		reg_sdp = RT5648_I2S3_SDP;
+		mask_clk = RT5648_I2S_BCLK_MS3_MASK;
+		val_clk = bclk_ms << RT5648_I2S_BCLK_MS3_SFT;
 		break;
 	default:
 		dev_err(codec->dev, "Invalid dai->id: %d\n", dai->id);
 		return -EINVAL;
 	}
 
+	mutex_lock(&rt5648->clk_lock);
+	rt5648->lrck[dai->id] = params_rate(params);
+	/* as a slave only the ratio given by the machine driver is known */
+	if (rt5648->master[dai->id])
+		rt5648->bclk[dai->id] = rt5648->lrck[dai->id] * (32 << bclk_ms);
+	else
+		rt5648->bclk[dai->id] = rt5648->lrck[dai->id] *
+			rt5648->bclk_ratio[dai->id];
+
+	dev_dbg(dai->dev, "bclk is %dHz and lrck is %dHz\n",
+		rt5648->bclk[dai->id], rt5648->lrck[dai->id]);
+	dev_dbg(dai->dev, "bclk_ms is %d for iis %d\n", bclk_ms, dai->id);
+
+	rt5648->aif_active |= RT5648_AIF_STREAM(dai->id, substream->stream);
+	ret = rt5648_clk_plan(codec, dai->id);
+	if (ret < 0)
+		rt5648->aif_active &=
+			~RT5648_AIF_STREAM(dai->id, substream->stream);
+	rt5648_aif2_gate(codec);
+	mutex_unlock(&rt5648->clk_lock);
+	if (ret < 0) {
+		dev_err(codec->dev, "Unsupported clock setting\n");
+		return ret;
+	}
+
+	snd_soc_update_bits(codec, reg_sdp, RT5648_I2S_DL_MASK, val_len);
+	snd_soc_update_bits(codec, RT5648_ADDA_CLK1, mask_clk, val_clk);
+
+	/*
+	 * The EQ banks follow the AIF1 rate.  Load this direction's bank now;
+	 * whether it is switched on is up to the speaker and recording
+	 * events, which then find nothing left to upload.
+	 */
+	if (dai->id == RT5648_AIF1) {
+		if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) {
+			rt5648_preload_eqmode(codec, EQ_CH_DACL,
+				rt5648->eq_mode);
+			rt5648_preload_eqmode(codec, EQ_CH_DACR,
+				rt5648->eq_mode);
+		} else {
+			rt5648_preload_eqmode(codec, EQ_CH_ADC,
+				rt5648->adc_eq_mode);
+		}
+	}
+
 	return 0;
 }
 
 static int rt5648_hw_free(struct snd_pcm_substream *substream,
-  struct snd_soc_dai *dai)
+	struct snd_soc_dai *dai)
 {
-  struct snd_soc_pcm_runtime *rtd = substream->private_data;
-  struct snd_soc_codec *codec = rtd->codec;
+	struct snd_soc_pcm_runtime *rtd = substream->private_data;
+	struct snd_soc_codec *codec = rtd->codec;
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
 
-  if (RT5648_AIF2 == dai->id)
-    snd_soc_update_bits(codec, RT5648_GEN_CTRL3, 0x2, 0x2);
+	mutex_lock(&rt5648->clk_lock);
+	rt5648->aif_active &= ~RT5648_AIF_STREAM(dai->id, substream->stream);
+	rt5648_clk_plan(codec, -1);
+	rt5648_aif2_gate(codec);
+	mutex_unlock(&rt5648->clk_lock);
 
-  return 0;
+	return 0;
 }
 
 static int rt5648_prepare(struct snd_pcm_substream *substream,
@@ -2671,14 +4065,15 @@ static int rt5648_set_dai_fmt(struct snd_soc_dai *dai, unsigned int fmt)
 	struct snd_soc_codec *codec = dai->codec;
 	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
 	unsigned int reg_val = 0;
+	int master;
 
 	switch (fmt & SND_SOC_DAIFMT_MASTER_MASK) {
 	case SND_SOC_DAIFMT_CBM_CFM:
-		rt5648->master[dai->id] = 1;
+		master = 1;
 		break;
 	case SND_SOC_DAIFMT_CBS_CFS:
 		reg_val |= RT5648_I2S_MS_S;
-		rt5648->master[dai->id] = 0;
+		master = 0;
 		break;
 	default:
 		return -EINVAL;
@@ -2716,7 +4111,12 @@ static int rt5648_set_dai_fmt(struct snd_soc_dai *dai, unsigned int fmt)
 			RT5648_I2S_DF_MASK, reg_val);
 		break;
 	case  RT5648_AIF2:
-		snd_soc_update_bits(codec, RT5648_I2S1_SDP,
+		snd_soc_update_bits(codec, RT5648_I2S2_SDP,
+			RT5648_I2S_MS_MASK | RT5648_I2S_BP_MASK |
+			RT5648_I2S_DF_MASK, reg_val);
+		break;
+	case RT5648_AIF3:
+		snd_soc_update_bits(codec, RT5648_I2S3_SDP,
 			RT5648_I2S_MS_MASK | RT5648_I2S_BP_MASK |
 			RT5648_I2S_DF_MASK, reg_val);
 		break;
@@ -2724,13 +4124,17 @@ static int rt5648_set_dai_fmt(struct snd_soc_dai *dai, unsigned int fmt)
 		dev_err(codec->dev, "Invalid dai->id: %d\n", dai->id);
 		return -EINVAL;
 	}
+
+	mutex_lock(&rt5648->clk_lock);
+	rt5648->master[dai->id] = master;
+	mutex_unlock(&rt5648->clk_lock);
+
 	return 0;
 }
 
-static int rt5648_set_dai_sysclk(struct snd_soc_dai *dai,
-		int clk_id, unsigned int freq, int dir)
+static int rt5648_set_sysclk(struct snd_soc_codec *codec, int clk_id,
+	unsigned int freq)
 {
-	struct snd_soc_codec *codec = dai->codec;
 	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
 	unsigned int reg_val = 0;
 
@@ -2756,8 +4160,153 @@ static int rt5648_set_dai_sysclk(struct snd_soc_dai *dai,
 	rt5648->sysclk = freq;
 	rt5648->sysclk_src = clk_id;
 
-	dev_dbg(dai->dev, "Sysclk is %dHz and clock id is %d\n", freq, clk_id);
+	dev_dbg(codec->dev, "Sysclk is %dHz and clock id is %d\n",
+		freq, clk_id);
+
+	return 0;
+}
+
+/*
+ * Giving the MCLK rate leaves sysclk to rt5648_clk_plan(); picking PLL1 or
+ * the RC clock pins sysclk to what the machine driver set up.
+ */
+static int rt5648_set_dai_sysclk(struct snd_soc_dai *dai,
+		int clk_id, unsigned int freq, int dir)
+{
+	struct snd_soc_codec *codec = dai->codec;
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+	int ret;
+
+	mutex_lock(&rt5648->clk_lock);
+	ret = rt5648_set_sysclk(codec, clk_id, freq);
+	if (!ret) {
+		rt5648->clk_manual = clk_id != RT5648_SCLK_S_MCLK;
+		if (clk_id == RT5648_SCLK_S_MCLK)
+			rt5648->mclk = freq;
+	}
+	mutex_unlock(&rt5648->clk_lock);
+
+	return ret;
+}
+
+/*
+ * Exact PLL codes for the usual MCLKs and 64/50/32fs BCLKs, with the VCO
+ * (freq_out * (K + 2)) kept around 100MHz.
+ * Fout = Fin * (N + 2) / ((M + 2) * (K + 2)), M + 2 is 1 when bypassed.
+ */
+static const struct rt5648_pll_preset {
+	unsigned int freq_in;
+	unsigned int freq_out;
+	bool m_bp;
+	int m_code;
+	int n_code;
+	int k_code;
+} rt5648_pll_preset_table[] = {
+	{ 256000, 24576000, true, 0, 382, 2 },
+	{ 256000, 22579200, true, 0, 439, 3 },
+	{ 256000, 12288000, true, 0, 382, 6 },
+	{ 256000, 11289600, true, 0, 439, 8 },
+	{ 512000, 24576000, true, 0, 190, 2 },
+	{ 512000, 22579200, false, 0, 439, 3 },
+	{ 512000, 12288000, true, 0, 190, 6 },
+	{ 512000, 11289600, false, 0, 439, 8 },
+	{ 1024000, 24576000, true, 0, 94, 2 },
+	{ 1024000, 22579200, false, 3, 439, 2 },
+	{ 1024000, 12288000, true, 0, 94, 6 },
+	{ 1024000, 11289600, false, 3, 439, 6 },
+	{ 1411200, 22579200, true, 0, 62, 2 },
+	{ 1411200, 11289600, true, 0, 70, 7 },
+	{ 1536000, 24576000, true, 0, 62, 2 },
+	{ 1536000, 22579200, false, 3, 292, 2 },
+	{ 1536000, 12288000, true, 0, 62, 6 },
+	{ 1536000, 11289600, false, 3, 292, 6 },
+	{ 2205000, 22579200, false, 3, 254, 3 },
+	{ 2205000, 11289600, false, 3, 254, 8 },
+	{ 2400000, 24576000, false, 3, 254, 3 },
+	{ 2400000, 12288000, false, 3, 254, 8 },
+	{ 2822400, 22579200, true, 0, 30, 2 },
+	{ 2822400, 11289600, true, 0, 34, 7 },
+	{ 3072000, 24576000, true, 0, 30, 2 },
+	{ 3072000, 22579200, false, 3, 145, 2 },
+	{ 3072000, 12288000, true, 0, 30, 6 },
+	{ 3072000, 11289600, false, 3, 145, 6 },
+	{ 12288000, 24576000, true, 0, 6, 2 },
+	{ 12288000, 22579200, false, 14, 145, 3 },
+	{ 12288000, 11289600, false, 14, 145, 8 },
+	{ 19200000, 24576000, false, 3, 30, 3 },
+	{ 19200000, 12288000, false, 3, 30, 8 },
+};
+
+/* Search results for inputs missing from the table */
+#define RT5648_PLL_MEMO_NUM			4
+
+static struct rt5648_pll_memo {
+	unsigned int freq_in;
+	unsigned int freq_out;
+	struct rt5648_pll_code code;
+} rt5648_pll_memo[RT5648_PLL_MEMO_NUM];
+static int rt5648_pll_memo_next;
+static DEFINE_MUTEX(rt5648_pll_memo_lock);
+
+/* VCO window searched for inputs missing from the table */
+#define RT5648_PLL_VCO_MIN			80000000
+#define RT5648_PLL_VCO_MAX			125000000
+
+/*
+ * For every K keeping the VCO in range and every M (and bypass) the
+ * nearest N is solved directly, so at most a few hundred steps are taken.
+ * If no K fits the window, K is picked for a ~100MHz VCO as before.
+ */
+static int rt5648_pll_search(unsigned int freq_in, unsigned int freq_out,
+	struct rt5648_pll_code *pll_code)
+{
+	u64 vco, target, in, err, best = U64_MAX;
+	int k, k_min, k_max, m, n, div;
+
+	k_min = DIV_ROUND_UP(RT5648_PLL_VCO_MIN, freq_out) - 2;
+	k_max = RT5648_PLL_VCO_MAX / freq_out - 2;
+	if (k_min < 0)
+		k_min = 0;
+	if (k_max > RT5648_PLL_K_MAX)
+		k_max = RT5648_PLL_K_MAX;
+	if (k_min > k_max) {
+		k_min = 100000000 / freq_out - 2;
+		if (k_min > RT5648_PLL_K_MAX)
+			k_min = RT5648_PLL_K_MAX;
+		if (k_min < 0)
+			k_min = 0;
+		k_max = k_min;
+	}
+
+	for (k = k_min; k <= k_max; k++) {
+		vco = (u64)freq_out * (k + 2);
+		for (m = -1; m <= RT5648_PLL_M_MAX; m++) {
+			div = m < 0 ? 1 : m + 2;
+			target = vco * div;
+			n = (int)div_u64(target + freq_in / 2, freq_in) - 2;
+			if (n < 0 || n > RT5648_PLL_N_MAX)
+				continue;
+
+			in = (u64)freq_in * (n + 2);
+			/* error at the output, comparable across M and K */
+			err = div_u64(in > target ? in - target : target - in,
+				div * (k + 2));
+			if (err < best) {
+				best = err;
+				pll_code->m_bp = m < 0;
+				pll_code->m_code = m < 0 ? 0 : m;
+				pll_code->n_code = n;
+				pll_code->k_code = k;
+				if (!err)
+					goto found;
+			}
+		}
+	}
 
+	if (best == U64_MAX)
+		return -EINVAL;
+	pr_debug("Only get approximation about PLL\n");
+found:
 	return 0;
 }
 
@@ -2767,72 +4316,70 @@ static int rt5648_set_dai_sysclk(struct snd_soc_dai *dai,
  * @freq_out: target clock which codec works on.
  * @pll_code: Pointer to structure with M, N, K and bypass flag.
  *
- * Calcualte M/N/K code to configure PLL for codec. And K is assigned to 2
- * which make calculation more efficiently.
+ * Look the M/N/K code up in rt5648_pll_preset_table, falling back to
+ * rt5648_pll_search() for other clocks.  Search results are remembered
+ * so switching back and forth between the same clocks stays cheap.
  *
  * Returns 0 for success or negative error code.
  */
 static int rt5648_pll_calc(const unsigned int freq_in,
 	const unsigned int freq_out, struct rt5648_pll_code *pll_code)
 {
-	int max_n = RT5648_PLL_N_MAX, max_m = RT5648_PLL_M_MAX;
-	int k, n, m, red, n_t, m_t, pll_out, in_t, out_t;
-	int red_t = abs(freq_out - freq_in);
-	bool bypass = false;
+	const struct rt5648_pll_preset *preset;
+	struct rt5648_pll_memo *memo;
+	int i, ret;
 
-	if (RT5648_PLL_INP_MAX < freq_in || RT5648_PLL_INP_MIN > freq_in)
+	if (RT5648_PLL_INP_MAX < freq_in || RT5648_PLL_INP_MIN > freq_in ||
+		!freq_out)
 		return -EINVAL;
 
-	k = 100000000 / freq_out - 2;
-	if (k > RT5648_PLL_K_MAX)
-		k = RT5648_PLL_K_MAX;
-	for (n_t = 0; n_t <= max_n; n_t++) {
-		in_t = freq_in / (k + 2);
-		pll_out = freq_out / (n_t + 2);
-		if (in_t < 0)
-			continue;
-		if (in_t == pll_out) {
-			bypass = true;
-			n = n_t;
-			goto code_find;
+	for (i = 0; i < ARRAY_SIZE(rt5648_pll_preset_table); i++) {
+		preset = &rt5648_pll_preset_table[i];
+		if (preset->freq_in == freq_in &&
+			preset->freq_out == freq_out) {
+			pll_code->m_bp = preset->m_bp;
+			pll_code->m_code = preset->m_code;
+			pll_code->n_code = preset->n_code;
+			pll_code->k_code = preset->k_code;
+			return 0;
 		}
-		red = abs(in_t - pll_out);
-		if (red < red_t) {
-			bypass = true;
-			n = n_t;
-			m = m_t;
-			if (red == 0)
-				goto code_find;
-			red_t = red;
-		}
-		for (m_t = 0; m_t <= max_m; m_t++) {
-			out_t = in_t / (m_t + 2);
-			red = abs(out_t - pll_out);
-			if (red < red_t) {
-				bypass = false;
-				n = n_t;
-				m = m_t;
-				if (red == 0)
-					goto code_find;
-				red_t = red;
-			}
+	}
+
+	mutex_lock(&rt5648_pll_memo_lock);
+	for (i = 0; i < RT5648_PLL_MEMO_NUM; i++) {
+		memo = &rt5648_pll_memo[i];
+		if (memo->freq_in == freq_in && memo->freq_out == freq_out) {
+			*pll_code = memo->code;
+			mutex_unlock(&rt5648_pll_memo_lock);
+			return 0;
 		}
 	}
-	pr_debug("Only get approximation about PLL\n");
 
-code_find:
+	ret = rt5648_pll_search(freq_in, freq_out, pll_code);
+	if (!ret) {
+		memo = &rt5648_pll_memo[rt5648_pll_memo_next];
+		memo->freq_in = freq_in;
+		memo->freq_out = freq_out;
+		memo->code = *pll_code;
+		rt5648_pll_memo_next = (rt5648_pll_memo_next + 1) %
+			RT5648_PLL_MEMO_NUM;
+	}
+	mutex_unlock(&rt5648_pll_memo_lock);
 
-	pll_code->m_bp = bypass;
-	pll_code->m_code = m;
-	pll_code->n_code = n;
-	pll_code->k_code = k;
-	return 0;
+	return ret;
 }
 
-static int rt5648_set_dai_pll(struct snd_soc_dai *dai, int pll_id, int source,
-			unsigned int freq_in, unsigned int freq_out)
+/* PLL1 source for the BCLK of each AIF */
+static const int rt5648_aif_bclk_src[RT5648_AIFS] = {
+	[RT5648_AIF1] = RT5648_PLL1_S_BCLK1,
+	[RT5648_AIF2] = RT5648_PLL1_S_BCLK2,
+	[RT5648_AIF3] = RT5648_PLL1_S_BCLK3,
+};
+
+/* source is RT5648_PLL1_S_*, with BCLK1/2/3 taken literally */
+static int rt5648_set_pll(struct snd_soc_codec *codec, int source,
+	unsigned int freq_in, unsigned int freq_out)
 {
-	struct snd_soc_codec *codec = dai->codec;
 	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
 	struct rt5648_pll_code pll_code;
 	int ret;
@@ -2857,20 +4404,16 @@ static int rt5648_set_dai_pll(struct snd_soc_dai *dai, int pll_id, int source,
 			RT5648_PLL1_SRC_MASK, RT5648_PLL1_SRC_MCLK);
 		break;
 	case RT5648_PLL1_S_BCLK1:
+		snd_soc_update_bits(codec, RT5648_GLB_CLK,
+			RT5648_PLL1_SRC_MASK, RT5648_PLL1_SRC_BCLK1);
+		break;
 	case RT5648_PLL1_S_BCLK2:
-		switch (dai->id) {
-		case RT5648_AIF1:
-			snd_soc_update_bits(codec, RT5648_GLB_CLK,
-				RT5648_PLL1_SRC_MASK, RT5648_PLL1_SRC_BCLK1);
-			break;
-		case  RT5648_AIF2:
-			snd_soc_update_bits(codec, RT5648_GLB_CLK,
-				RT5648_PLL1_SRC_MASK, RT5648_PLL1_SRC_BCLK2);
-			break;
-		default:
-			dev_err(codec->dev, "Invalid dai->id: %d\n", dai->id);
-			return -EINVAL;
-		}
+		snd_soc_update_bits(codec, RT5648_GLB_CLK,
+			RT5648_PLL1_SRC_MASK, RT5648_PLL1_SRC_BCLK2);
+		break;
+	case RT5648_PLL1_S_BCLK3:
+		snd_soc_update_bits(codec, RT5648_GLB_CLK,
+			RT5648_PLL1_SRC_MASK, RT5648_PLL1_SRC_BCLK3);
 		break;
 	default:
 		dev_err(codec->dev, "Unknown PLL source %d\n", source);
@@ -2900,11 +4443,181 @@ static int rt5648_set_dai_pll(struct snd_soc_dai *dai, int pll_id, int source,
 	return 0;
 }
 
+static int rt5648_set_dai_pll(struct snd_soc_dai *dai, int pll_id, int source,
+			unsigned int freq_in, unsigned int freq_out)
+{
+	struct snd_soc_codec *codec = dai->codec;
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+	int ret;
+
+	/* a BCLK source means the BCLK of this DAI */
+	if (source == RT5648_PLL1_S_BCLK1 || source == RT5648_PLL1_S_BCLK2 ||
+		source == RT5648_PLL1_S_BCLK3) {
+		if (dai->id < 0 || dai->id >= RT5648_AIFS) {
+			dev_err(codec->dev, "Invalid dai->id: %d\n", dai->id);
+			return -EINVAL;
+		}
+		source = rt5648_aif_bclk_src[dai->id];
+	}
+
+	mutex_lock(&rt5648->clk_lock);
+	ret = rt5648_set_pll(codec, source, freq_in, freq_out);
+	if (!ret && source == RT5648_PLL1_S_MCLK && freq_in)
+		rt5648->mclk = freq_in;
+	mutex_unlock(&rt5648->clk_lock);
+
+	return ret;
+}
+
+/* sysclk the planner aims for: 512fs, or 256fs above 48kHz */
+#define RT5648_SYSCLK_MAX			24576000
+
+/* Pick sysclk for the only running stream on @id */
+static int rt5648_clk_plan_sysclk(struct snd_soc_codec *codec, int id)
+{
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+	int rate = rt5648->lrck[id];
+	int out = rate * 512;
+	int ret;
+
+	if (out > RT5648_SYSCLK_MAX)
+		out = rate * 256;
+
+	if (rt5648->mclk > 0 && get_clk_info(rt5648->mclk, rate) >= 0)
+		return rt5648_set_sysclk(codec, RT5648_SCLK_S_MCLK,
+			rt5648->mclk);
+
+	if (rt5648->mclk > 0) {
+		ret = rt5648_set_pll(codec, RT5648_PLL1_S_MCLK,
+			rt5648->mclk, out);
+	} else if (!rt5648->master[id]) {
+		if (!rt5648->bclk[id]) {
+			dev_err(codec->dev,
+				"AIF%d BCLK ratio unknown, set it with "
+				"snd_soc_dai_set_bclk_ratio()\n", id + 1);
+			return -EINVAL;
+		}
+		ret = rt5648_set_pll(codec, rt5648_aif_bclk_src[id],
+			rt5648->bclk[id], out);
+	} else {
+		ret = -EINVAL;
+	}
+	if (ret < 0) {
+		dev_err(codec->dev, "No clock to derive sysclk from\n");
+		return ret;
+	}
+
+	return rt5648_set_sysclk(codec, RT5648_SCLK_S_PLL1, out);
+}
+
+/* Is AIF @id clocked from the same source as sysclk? */
+static bool rt5648_clk_sync(struct rt5648_priv *rt5648, int id)
+{
+	if (rt5648->master[id])
+		return true;
+
+	switch (rt5648->sysclk_src) {
+	case RT5648_SCLK_S_MCLK:
+		return true;
+	case RT5648_SCLK_S_PLL1:
+		if (rt5648->pll_src == RT5648_PLL1_S_MCLK)
+			return true;
+		return rt5648->pll_src == rt5648_aif_bclk_src[id];
+	default:
+		return false;
+	}
+}
+
+/**
+ * rt5648_clk_plan - Plan the clock tree for the active streams.
+ * @codec: SoC audio codec device.
+ * @id: DAI whose hw_params are being applied, or -1 when a stream stops.
+ *
+ * The first stream to start picks sysclk: MCLK when it divides down to
+ * the rate, otherwise PLL1 from MCLK or from the stream's own BCLK, whose
+ * ratio must have come from set_bclk_ratio() or set_tdm_slot().  A stream
+ * joining a running one keeps that sysclk.  Each AIF then gets the I2S
+ * pre-divider matching sysclk.  AIFs that cannot be derived from sysclk,
+ * or run off another master's BCLK, go through ASRC (all of them with
+ * force_asrc), and only the filters the muxes currently route their
+ * active streams through are switched over.
+ *
+ * Called with clk_lock held.  Returns 0 for success or negative error code.
+ */
+static int rt5648_clk_plan(struct snd_soc_codec *codec, int id)
+{
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+	int pd[RT5648_AIFS] = { 0 };
+	unsigned int mask = 0;
+	bool async;
+	int i, stream, ret;
+
+	if (id >= 0 && !rt5648->clk_manual &&
+		!(rt5648->aif_active & ~RT5648_AIF_STREAMS(id))) {
+		ret = rt5648_clk_plan_sysclk(codec, id);
+		if (ret < 0)
+			return ret;
+	}
+
+	for (i = 0; i < RT5648_AIFS; i++) {
+		if (!(rt5648->aif_active & RT5648_AIF_STREAMS(i)))
+			continue;
+		pd[i] = get_clk_info(rt5648->sysclk, rt5648->lrck[i]);
+		async = force_asrc || pd[i] < 0 ||
+			!rt5648_clk_sync(rt5648, i);
+		if (!async)
+			continue;
+
+		pd[i] = 0;
+		for (stream = 0; stream < 2; stream++)
+			if (rt5648->aif_active & RT5648_AIF_STREAM(i, stream))
+				mask |= rt5648_asrc_filter(codec, i, stream);
+	}
+
+	if (rt5648->aif_active & RT5648_AIF_STREAMS(RT5648_AIF1))
+		snd_soc_update_bits(codec, RT5648_ADDA_CLK1,
+			RT5648_I2S_PD1_MASK,
+			pd[RT5648_AIF1] << RT5648_I2S_PD1_SFT);
+	if (rt5648->aif_active & RT5648_AIF_STREAMS(RT5648_AIF2))
+		snd_soc_update_bits(codec, RT5648_ADDA_CLK1,
+			RT5648_I2S_PD2_MASK,
+			pd[RT5648_AIF2] << RT5648_I2S_PD2_SFT);
+	if (rt5648->aif_active & RT5648_AIF_STREAMS(RT5648_AIF3))
+		snd_soc_update_bits(codec, RT5648_ADDA_CLK1,
+			RT5648_I2S_PD3_MASK,
+			pd[RT5648_AIF3] << RT5648_I2S_PD3_SFT);
+
+	if (mask != rt5648->asrc_mask)
+		dev_dbg(codec->dev, "ASRC filters %#x\n", mask);
+	rt5648->asrc_mask = mask;
+	rt5648_asrc_apply(codec);
+
+	return 0;
+}
+
+/* BCLK cycles per LRCK of a slave DAI, used to run PLL1 from its BCLK */
+static int rt5648_set_bclk_ratio(struct snd_soc_dai *dai, unsigned int ratio)
+{
+	struct snd_soc_codec *codec = dai->codec;
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+
+	if (dai->id < 0 || dai->id >= RT5648_AIFS) {
+		dev_err(codec->dev, "Invalid dai->id: %d\n", dai->id);
+		return -EINVAL;
+	}
+
+	mutex_lock(&rt5648->clk_lock);
+	rt5648->bclk_ratio[dai->id] = ratio;
+	mutex_unlock(&rt5648->clk_lock);
+
+	return 0;
+}
 
 static int rt5648_set_tdm_slot(struct snd_soc_dai *dai, unsigned int tx_mask,
 			unsigned int rx_mask, int slots, int slot_width)
 {
 	struct snd_soc_codec *codec = dai->codec;
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
 	unsigned int val = 0;
 
 	if (rx_mask || tx_mask)
@@ -2942,6 +4655,14 @@ static int rt5648_set_tdm_slot(struct snd_soc_dai *dai, unsigned int tx_mask,
 
 	snd_soc_update_bits(codec, RT5648_TDM_CTRL_1, 0x7c00, val);
 
+	/* a TDM frame is slots * slot_width BCLKs long */
+	if (slots > 0 && slot_width > 0 &&
+		dai->id >= 0 && dai->id < RT5648_AIFS) {
+		mutex_lock(&rt5648->clk_lock);
+		rt5648->bclk_ratio[dai->id] = slots * slot_width;
+		mutex_unlock(&rt5648->clk_lock);
+	}
+
 	return 0;
 }
 
@@ -3025,6 +4746,42 @@ static ssize_t rt5648_index_store(struct device *dev,
 }
 static DEVICE_ATTR(index_reg, 0664, rt5648_index_show, rt5648_index_store);
 
+/* private window traffic since the last write to the node */
+static ssize_t rt5648_pr_stats_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct i2c_client *client = to_i2c_client(dev);
+	struct rt5648_priv *rt5648 = i2c_get_clientdata(client);
+	struct rt5648_pr_stats stats;
+
+	rt5648_pr_lock(rt5648);
+	stats = rt5648->pr_stats;
+	rt5648_pr_unlock(rt5648);
+
+	return scnprintf(buf, PAGE_SIZE,
+		"writes: %u\nreads: %u\nindex messages: %u\n"
+		"index skipped: %u\ni2c transfers: %u\n"
+		"last bulk write: %u registers in %u us\n",
+		stats.writes, stats.reads, stats.index_msgs,
+		stats.index_skipped, stats.xfers, stats.bulk_num,
+		stats.bulk_us);
+}
+
+static ssize_t rt5648_pr_stats_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct i2c_client *client = to_i2c_client(dev);
+	struct rt5648_priv *rt5648 = i2c_get_clientdata(client);
+
+	rt5648_pr_lock(rt5648);
+	memset(&rt5648->pr_stats, 0, sizeof(rt5648->pr_stats));
+	rt5648_pr_unlock(rt5648);
+
+	return count;
+}
+static DEVICE_ATTR(pr_stats, 0644, rt5648_pr_stats_show,
+	rt5648_pr_stats_store);
+
 static ssize_t rt5648_codec_show(struct device *dev,
 	struct device_attribute *attr, char *buf)
 {
@@ -3084,6 +4841,13 @@ static ssize_t rt5648_codec_store(struct device *dev,struct device_attribute *at
 	if (addr > RT5648_VENDOR_ID2 || val > 0xffff || val < 0)
 		return count;
 
+	/* raw access to the private window moves PRIV_INDEX */
+	if (addr == RT5648_PRIV_INDEX || addr == RT5648_PRIV_DATA) {
+		rt5648_pr_lock(rt5648);
+		rt5648->pr_index = -1;
+		rt5648_pr_unlock(rt5648);
+	}
+
 	if (i == count)
 		pr_info("0x%02x = 0x%04x\n", addr, snd_soc_read(codec, addr));
 	else
@@ -3109,6 +4873,7 @@ static int rt5648_set_bias_level(struct snd_soc_codec *codec,
 
 	case SND_SOC_BIAS_STANDBY:
 		if (SND_SOC_BIAS_OFF == snd_soc_codec_get_bias_level(codec)) {
+			rt5648_leave_cache_only(rt5648);
 			snd_soc_update_bits(codec, RT5648_PWR_ANLG1,
 				RT5648_PWR_VREF1 | RT5648_PWR_MB |
 				RT5648_PWR_BG | RT5648_PWR_VREF2,
@@ -3120,26 +4885,31 @@ static int rt5648_set_bias_level(struct snd_soc_codec *codec,
 				RT5648_PWR_FV1 | RT5648_PWR_FV2);
 			snd_soc_update_bits(codec, RT5648_DIG_MISC,
 				RT5648_DIG_GATE_CTRL, RT5648_DIG_GATE_CTRL);
-			snd_soc_cache_sync(codec);
-			rt5648_index_sync(codec);
+			rt5648_sync_cache(rt5648);
 		}
 		break;
 
 	case SND_SOC_BIAS_OFF:
-		snd_soc_write(codec, RT5648_DEPOP_M2, 0x1100);
+		rt5648_hp_works_cancel(rt5648);
+		snd_soc_update_bits(codec, RT5648_DEPOP_M2, 0xffff, 0x1100);
 		snd_soc_update_bits(codec, RT5648_DIG_MISC,
 				RT5648_DIG_GATE_CTRL, 0);
-		snd_soc_write(codec, RT5648_PWR_DIG1, 0x0000);
-		snd_soc_write(codec, RT5648_PWR_DIG2, 0x0000);
-		snd_soc_write(codec, RT5648_PWR_VOL, 0x0000);
-		snd_soc_write(codec, RT5648_PWR_MIXER, 0x0002);
+		snd_soc_update_bits(codec, RT5648_PWR_DIG1, 0xffff, 0x0000);
+		snd_soc_update_bits(codec, RT5648_PWR_DIG2, 0xffff, 0x0000);
+		snd_soc_update_bits(codec, RT5648_PWR_VOL, 0xffff, 0x0000);
+		snd_soc_update_bits(codec, RT5648_PWR_MIXER, 0xffff, 0x0002);
 		if (rt5648->jack_type == SND_JACK_HEADSET) {
-			snd_soc_write(codec, RT5648_PWR_ANLG1, 0x2802);
-			snd_soc_write(codec, RT5648_PWR_ANLG2, 0x0804);
+			snd_soc_update_bits(codec, RT5648_PWR_ANLG1, 0xffff,
+				0x2802);
+			snd_soc_update_bits(codec, RT5648_PWR_ANLG2, 0xffff,
+				0x0804);
 		} else {
-			snd_soc_write(codec, RT5648_PWR_ANLG1, 0x0000);
-			snd_soc_write(codec, RT5648_PWR_ANLG2, 0x0000);
+			snd_soc_update_bits(codec, RT5648_PWR_ANLG1, 0xffff,
+				0x0000);
+			snd_soc_update_bits(codec, RT5648_PWR_ANLG2, 0xffff,
+				0x0000);
 		}
+		rt5648_enter_cache_only(rt5648);
 		break;
 
 	default:
@@ -3165,6 +4935,7 @@ static int rt5648_probe(struct snd_soc_codec *codec)
 	snd_soc_codec_get_dapm(codec)->idle_bias_off = 1;
 
 	rt5648_reset(codec);
+	regcache_mark_dirty(rt5648->regmap);
 	snd_soc_update_bits(codec, RT5648_PWR_ANLG1,
 		RT5648_PWR_VREF1 | RT5648_PWR_MB |
 		RT5648_PWR_BG | RT5648_PWR_VREF2,
@@ -3177,18 +4948,27 @@ static int rt5648_probe(struct snd_soc_codec *codec)
 
 	snd_soc_update_bits(codec, RT5648_DIG_MISC,
 				RT5648_DIG_GATE_CTRL, RT5648_DIG_GATE_CTRL);
-	rt5648_reg_init(codec);
-
-	snd_soc_update_bits(codec, RT5648_PWR_ANLG1, RT5648_LDO_SEL_MASK, 0x0);
-
-  snd_soc_update_bits(codec, RT5648_GEN_CTRL3, 0x2, 0x2);
+	ret = rt5648_reg_init(codec);
+	if (ret < 0)
+		return ret;
 
 	/* dc_calibrate(codec); */
 	snd_soc_codec_get_dapm(codec)->bias_level = SND_SOC_BIAS_STANDBY;
 	rt5648->codec = codec;
+	mutex_init(&rt5648->hp_lock);
+	INIT_DELAYED_WORK(&rt5648->hp_amp_work, rt5648_hp_amp_work);
+	INIT_DELAYED_WORK(&rt5648->hp_depop_work, rt5648_hp_depop_work);
+	mutex_init(&rt5648->jd_lock);
+	INIT_DELAYED_WORK(&rt5648->jd_work, rt5648_jd_work);
+	INIT_DELAYED_WORK(&rt5648->jack_work, rt5648_jack_work);
+	init_completion(&rt5648->jd_done);
+	ret = rt5648_eq_init(codec);
+	if (ret < 0)
+		return ret;
 
 	snd_soc_add_codec_controls(codec, rt5648_snd_controls,
 			ARRAY_SIZE(rt5648_snd_controls));
+	rt5648_eq_add_controls(codec);
 	snd_soc_dapm_new_controls(snd_soc_codec_get_dapm(codec), rt5648_dapm_widgets,
 			ARRAY_SIZE(rt5648_dapm_widgets));
 	snd_soc_dapm_add_routes(snd_soc_codec_get_dapm(codec), rt5648_dapm_routes,
@@ -3199,13 +4979,24 @@ static int rt5648_probe(struct snd_soc_codec *codec)
 	ioctl_ops->index_write = rt5648_index_write;
 	ioctl_ops->index_read = rt5648_index_read;
 	ioctl_ops->index_update_bits = rt5648_index_update_bits;
+	ioctl_ops->index_bulk_write = rt5648_index_bulk_write;
 	ioctl_ops->ioctl_common = rt5648_ioctl_common;
+	ioctl_ops->reg_read = rt5648_space_read;
+	ioctl_ops->get_reg_page = rt5648_get_reg_page;
+	ioctl_ops->prog_lock = rt5648_prog_lock;
+	ioctl_ops->prog_unlock = rt5648_prog_unlock;
+	rt5648->reg_page = rt_codec_reg_page_alloc();
+	if (rt5648->reg_page == NULL)
+		dev_warn(codec->dev, "No memory for the register mirror\n");
 	realtek_ce_init_hwdep(codec);
 #endif
 #endif
+	rt5648_mirror_init(rt5648);
+	rt5648_eq_fw_request(codec);
 	/* Oder 140117 start */
 	rt5648->eq_mode = SPK;
 	/* Oder 140117 end */
+	rt5648->adc_eq_mode = NORMAL;
 	
 	ret = device_create_file(codec->dev, &dev_attr_index_reg);
 	if (ret != 0) {
@@ -3221,6 +5012,11 @@ static int rt5648_probe(struct snd_soc_codec *codec)
 		return ret;
 	}
 
+	ret = device_create_file(codec->dev, &dev_attr_pr_stats);
+	if (ret != 0)
+		dev_warn(codec->dev,
+			"Failed to create pr_stats sysfs file: %d\n", ret);
+
 	/* tf103cg FOR MIC agc function*/
 	is_recording = 0;
 	/* tf103cg FOR MIC agc function*/
@@ -3240,19 +5036,75 @@ static int rt5648_probe(struct snd_soc_codec *codec)
 
 static int rt5648_remove(struct snd_soc_codec *codec)
 {
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+#ifdef RTK_IOCTL
+#if defined(CONFIG_SND_HWDEP) || defined(CONFIG_SND_HWDEP_MODULE)
+	struct rt_codec_reg_page *page;
+#endif
+#endif
+
+	rt5648_eq_exit(codec);
+	cancel_delayed_work_sync(&rt5648->hp_amp_work);
+	cancel_delayed_work_sync(&rt5648->hp_depop_work);
+	rt5648_irq_release(rt5648);
+	cancel_delayed_work_sync(&rt5648->jd_work);
 	rt5648_set_bias_level(codec, SND_SOC_BIAS_OFF);
+	rt5648_eq_fw_release(codec);
+#ifdef RTK_IOCTL
+#if defined(CONFIG_SND_HWDEP) || defined(CONFIG_SND_HWDEP_MODULE)
+	page = rt5648->reg_page;
+	rt5648->reg_page = NULL;
+	rt_codec_reg_page_free(page);
+#endif
+#endif
 	return 0;
 }
 
 #ifdef CONFIG_PM
+/**
+ * rt5648_check_reg_lost - Find out whether the codec lost its registers.
+ * @codec: SoC audio codec device.
+ *
+ * CHARGE_PUMP is only written by init_list and differs from its reset
+ * value, so if the hardware no longer matches the cache the part has been
+ * reset or lost power.  Both caches are then marked dirty so the next
+ * STANDBY transition replays every register that differs from its reset
+ * default instead of only those written while cache-only.
+ */
+static void rt5648_check_reg_lost(struct snd_soc_codec *codec)
+{
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+	unsigned int cache, hw;
+	int ret;
+
+	rt5648_live_io_begin(rt5648);
+	regmap_read(rt5648->regmap, RT5648_CHARGE_PUMP, &cache);
+	regcache_cache_bypass(rt5648->regmap, true);
+	ret = regmap_read(rt5648->regmap, RT5648_CHARGE_PUMP, &hw);
+	regcache_cache_bypass(rt5648->regmap, false);
+	rt5648_live_io_end(rt5648);
+	if (ret == 0 && hw == cache)
+		return;
+
+	dev_dbg(codec->dev, "register state lost, resyncing\n");
+	regcache_mark_dirty(rt5648->regmap);
+	rt5648_pr_lock(rt5648);
+	rt5648->pr_index = -1;
+	regcache_mark_dirty(rt5648->pr_regmap);
+	rt5648_pr_unlock(rt5648);
+	rt5648->reg_lost = true;
+}
+
 static int rt5648_suspend(struct snd_soc_codec *codec)
 {
+	rt5648_hp_works_cancel(snd_soc_codec_get_drvdata(codec));
 	rt5648_set_bias_level(codec, SND_SOC_BIAS_OFF);
 	return 0;
 }
 
 static int rt5648_resume(struct snd_soc_codec *codec)
 {
+	rt5648_check_reg_lost(codec);
 	rt5648_set_bias_level(codec, SND_SOC_BIAS_STANDBY);
 	return 0;
 }
@@ -3272,6 +5124,7 @@ struct snd_soc_dai_ops rt5648_aif_dai_ops = {
 	.set_fmt = rt5648_set_dai_fmt,
 	.set_sysclk = rt5648_set_dai_sysclk,
 	.set_tdm_slot = rt5648_set_tdm_slot,
+	.set_bclk_ratio = rt5648_set_bclk_ratio,
 	.set_pll = rt5648_set_dai_pll,
 };
 
@@ -3294,6 +5147,8 @@ struct snd_soc_dai_driver rt5648_dai[] = {
 			.formats = RT5648_FORMATS,
 		},
 		.ops = &rt5648_aif_dai_ops,
+		/* playback and capture of one AIF share its LRCK */
+		.symmetric_rates = 1,
 	},
 	{
 		.name = "rt5648-aif2",
@@ -3313,6 +5168,29 @@ struct snd_soc_dai_driver rt5648_dai[] = {
 			.formats = RT5648_FORMATS,
 		},
 		.ops = &rt5648_aif_dai_ops,
+		/* playback and capture of one AIF share its LRCK */
+		.symmetric_rates = 1,
+	},
+	{
+		.name = "rt5648-aif3",
+		.id = RT5648_AIF3,
+		.playback = {
+			.stream_name = "AIF3 Playback",
+			.channels_min = 1,
+			.channels_max = 2,
+			.rates = RT5648_STEREO_RATES,
+			.formats = RT5648_FORMATS,
+		},
+		.capture = {
+			.stream_name = "AIF3 Capture",
+			.channels_min = 1,
+			.channels_max = 2,
+			.rates = RT5648_STEREO_RATES,
+			.formats = RT5648_FORMATS,
+		},
+		.ops = &rt5648_aif_dai_ops,
+		/* playback and capture of one AIF share its LRCK */
+		.symmetric_rates = 1,
 	},
 };
 
@@ -3322,12 +5200,34 @@ static struct snd_soc_codec_driver soc_codec_dev_rt5648 = {
 	.suspend = rt5648_suspend,
 	.resume = rt5648_resume,
 	.set_bias_level = rt5648_set_bias_level,
-	.reg_cache_size = RT5648_VENDOR_ID2 + 1,
-	.reg_word_size = sizeof(u16),
-	.reg_cache_default = rt5648_reg,
-	//.volatile_register = rt5648_volatile_register,
-	//.readable_register = rt5648_readable_register,
-	.reg_cache_step = 1,
+	.get_regmap = rt5648_get_regmap,
+};
+
+static const struct regmap_config rt5648_regmap = {
+	.reg_bits = 8,
+	.val_bits = 16,
+	.max_register = RT5648_VENDOR_ID2,
+	.volatile_reg = rt5648_volatile_register,
+	.readable_reg = rt5648_readable_register,
+	.writeable_reg = rt5648_writeable_register,
+	.precious_reg = rt5648_precious_register,
+#ifndef REG_BURST
+	.use_single_rw = true,
+#endif
+	.cache_type = REGCACHE_RBTREE,
+	.reg_defaults = rt5648_reg,
+	.num_reg_defaults = ARRAY_SIZE(rt5648_reg),
+};
+
+static const struct regmap_config rt5648_pr_regmap = {
+	.name = "private",
+	.reg_bits = 8,
+	.val_bits = 16,
+	.max_register = 0xff,
+	.volatile_reg = rt5648_pr_volatile_register,
+	.reg_read = rt5648_pr_reg_read,
+	.reg_write = rt5648_pr_reg_write,
+	.cache_type = REGCACHE_RBTREE,
 };
 
 static const struct i2c_device_id rt5648_i2c_id[] = {
@@ -3348,6 +5248,7 @@ static int rt5648_i2c_probe(struct i2c_client *i2c,
 		    const struct i2c_device_id *id)
 {
 	struct rt5648_priv *rt5648;
+	struct regmap_config config;
 	int ret;
 
 	rt5648 = kzalloc(sizeof(struct rt5648_priv), GFP_KERNEL);
@@ -3355,6 +5256,49 @@ static int rt5648_i2c_probe(struct i2c_client *i2c,
 		return -ENOMEM;
 
 	i2c_set_clientdata(i2c, rt5648);
+	rt5648->i2c = i2c;
+	rt5648->pr_index = -1;
+	mutex_init(&rt5648->io_lock);
+	mutex_init(&rt5648->pr_lock);
+	mutex_init(&rt5648->cache_lock);
+	mutex_init(&rt5648->clk_lock);
+
+	rt5648->pr_burst = devm_kzalloc(&i2c->dev, sizeof(*rt5648->pr_burst),
+		GFP_KERNEL);
+	rt5648->reg_snap = devm_kzalloc(&i2c->dev, sizeof(*rt5648->reg_snap),
+		GFP_KERNEL);
+	rt5648->pr_snap = devm_kzalloc(&i2c->dev, sizeof(*rt5648->pr_snap),
+		GFP_KERNEL);
+	if (NULL == rt5648->pr_burst || NULL == rt5648->reg_snap ||
+		NULL == rt5648->pr_snap) {
+		kfree(rt5648);
+		return -ENOMEM;
+	}
+
+
+	rt5648->pr_regmap = devm_regmap_init(&i2c->dev, NULL, rt5648,
+		&rt5648_pr_regmap);
+	if (IS_ERR(rt5648->pr_regmap)) {
+		ret = PTR_ERR(rt5648->pr_regmap);
+		dev_err(&i2c->dev,
+			"Failed to allocate private register map: %d\n", ret);
+		kfree(rt5648);
+		return ret;
+	}
+
+	config = rt5648_regmap;
+	config.lock = rt5648_io_lock;
+	config.unlock = rt5648_io_unlock;
+	config.lock_arg = rt5648;
+	rt5648->regmap = devm_regmap_init(&i2c->dev, &rt5648_bus, rt5648,
+		&config);
+	if (IS_ERR(rt5648->regmap)) {
+		ret = PTR_ERR(rt5648->regmap);
+		dev_err(&i2c->dev, "Failed to allocate register map: %d\n",
+			ret);
+		kfree(rt5648);
+		return ret;
+	}
 
 	ret = snd_soc_register_codec(&i2c->dev, &soc_codec_dev_rt5648,
 			rt5648_dai, ARRAY_SIZE(rt5648_dai));
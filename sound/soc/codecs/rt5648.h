@@ -2206,6 +2206,8 @@ enum {
 #define RT5648_REG_DISP_LEN 23
 
 int rt5648_headset_detect(struct snd_soc_codec *codec, int jack_insert);
+int rt5648_set_jack_detect(struct snd_soc_codec *codec,
+	struct snd_soc_jack *jack);
 int rt5648_check_interrupt_event(struct snd_soc_codec *codec);
 
 /* System Clock Source */
@@ -2220,14 +2222,20 @@ enum {
 	RT5648_PLL1_S_MCLK,
 	RT5648_PLL1_S_BCLK1,
 	RT5648_PLL1_S_BCLK2,
+	RT5648_PLL1_S_BCLK3,
 };
 
 enum {
 	RT5648_AIF1,
 	RT5648_AIF2,
+	RT5648_AIF3,
 	RT5648_AIFS,
 };
 
+/* rt5648_priv.aif_active bits */
+#define RT5648_AIF_STREAM(id, stream)		(1 << ((id) * 2 + (stream)))
+#define RT5648_AIF_STREAMS(id)			(3 << ((id) * 2))
+
 enum {
 	RT5648_DMIC_DIS,
 	RT5648_DMIC1,
@@ -2242,6 +2250,27 @@ enum {
 	RT5648_UN_EVENT = BIT(4), /* Unknown */
 };
 
+/* Headphone amp power-up, see rt5648_hp_amp_work() */
+enum {
+	RT5648_HP_AMP_OFF,
+	RT5648_HP_AMP_SETTLE, /* DC calibration settling */
+	RT5648_HP_AMP_RAMP, /* amp on, waiting to enable the charge pump */
+	RT5648_HP_AMP_ON,
+};
+
+/* Headset type detection, see rt5648_headset_detect() */
+enum {
+	RT5648_JD_IDLE,
+	RT5648_JD_DETECT, /* MICBIAS1 up, waiting on MB1 over-current */
+	RT5648_JD_DONE,
+};
+
+/* Outputs fed by the headphone amp */
+enum {
+	RT5648_AMP_OUT_HP = BIT(0),
+	RT5648_AMP_OUT_LOUT = BIT(1),
+};
+
 struct rt5648_pll_code {
 	bool m_bp; /* Indicates bypass m code or not. */
 	int m_code;
@@ -2249,26 +2278,99 @@ struct rt5648_pll_code {
 	int k_code;
 };
 
+struct rt5648_pr_burst;
+
+/* private window traffic, reported through the pr_stats sysfs node */
+struct rt5648_pr_stats {
+	u32 writes; /* private register writes that reached the window */
+	u32 reads;
+	u32 index_msgs; /* PRIV_INDEX messages sent */
+	u32 index_skipped; /* PRIV_INDEX messages saved by pr_index */
+	u32 xfers; /* i2c transfers, a burst counts once */
+	u32 bulk_num; /* registers in the last rt5648_index_bulk_write() */
+	u32 bulk_us; /* and its duration */
+};
+struct rt_codec_reg_page;
+struct rt5648_eq;
+
+#define RT5648_SNAP_SIZE			0x100
+
+/* Register cache contents as of entering cache-only mode */
+struct rt5648_reg_snap {
+	u16 val[RT5648_SNAP_SIZE];
+	unsigned long valid[BITS_TO_LONGS(RT5648_SNAP_SIZE)];
+	unsigned long dirty[BITS_TO_LONGS(RT5648_SNAP_SIZE)];
+};
+
 struct rt5648_priv {
 	struct snd_soc_codec *codec;
+	struct i2c_client *i2c;
+	struct regmap *regmap;
+	struct regmap *pr_regmap;
+	struct rt5648_pr_burst *pr_burst;
+	struct mutex io_lock; /* main map lock, see rt5648_io_lock() */
+	struct task_struct *io_owner;
+	int io_depth;
+	struct mutex pr_lock;
+	int pr_index; /* PRIV_INDEX as last programmed, -1 if unknown */
+	struct rt5648_pr_stats pr_stats;
+
+	struct mutex cache_lock;
+	bool cache_only; /* bias is OFF, register writes stay in the cache */
+	bool reg_lost; /* codec was reset, replay everything on STANDBY */
+	struct rt5648_reg_snap *reg_snap;
+	struct rt5648_reg_snap *pr_snap;
+	struct rt_codec_reg_page *reg_page;
 
 	int aif_pu;
 	int sysclk;
 	int sysclk_src;
 	int lrck[RT5648_AIFS];
 	int bclk[RT5648_AIFS];
+	int bclk_ratio[RT5648_AIFS]; /* of a slave AIF, 0 if not given */
 	int master[RT5648_AIFS];
 
 	int pll_src;
 	int pll_in;
 	int pll_out;
 
+	struct mutex clk_lock;
+	int mclk; /* MCLK rate given by the machine driver, 0 if unknown */
+	bool clk_manual; /* machine driver picked the sysclk source */
+	unsigned int aif_active; /* RT5648_AIF_STREAM()s past hw_params */
+	unsigned int asrc_mask; /* ASRC_2 filter modes for the active streams */
+	bool asrc_on; /* "ASRC" supply is powered */
+
 	int eq_mode;
+	int adc_eq_mode;
+	struct rt5648_eq *eq;
 	int dmic_en;
 
 	int jd_status;
 	int bp_status;
 	int jack_type;
+	struct snd_soc_jack *jack;
+	struct mutex jd_lock;
+	int jd_state;
+	unsigned int jd_anlg1; /* PWR_ANLG1/2 before detection */
+	unsigned int jd_anlg2;
+	struct delayed_work jd_work;
+	struct completion jd_done;
+	int irq; /* jack IRQ owned by the codec, 0 if the platform polls */
+	struct gpio_desc *jd_gpio;
+	unsigned int irq_st; /* INT_IRQ_ST/IRQ_CTRL3 at the last IRQ */
+	unsigned int irq_ctrl3;
+	unsigned long jack_deadline; /* jiffies jack_work is due at */
+	struct delayed_work jack_work;
+
+	int hp_amp_count;
+	struct mutex hp_lock;
+	int hp_amp_state;
+	unsigned int amp_out_want; /* RT5648_AMP_OUT_* DAPM has powered */
+	unsigned int amp_out_on; /* RT5648_AMP_OUT_* actually unmuted */
+	struct delayed_work hp_amp_work;
+	struct delayed_work hp_depop_work;
+	ktime_t hp_pmd_settle; /* mute ramp end, 0 if none */
 };
 
 #endif /* __RT5648_H__ */
@@ -10,12 +10,22 @@
  */
 
 #include <linux/spi/spi.h>
+#include <linux/ktime.h>
+#include <linux/firmware.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
 #include <sound/soc.h>
 #include "rt_codec_ioctl.h"
 #include "rt5648_ioctl.h"
 #include "rt5648.h"
 
-hweq_t hweq_param[] = {
+/*
+ * Built-in banks, tuned at 48kHz.  Other rates should come from a rate
+ * specific firmware preset or RT5648_EQ_USER; these are the fallback.
+ */
+#define RT5648_HWEQ_RATE 48000
+static const hweq_t hweq_param[] = {
 	{/* NORMAL */
 		{0},
 		{0},
@@ -54,109 +64,1157 @@ hweq_t hweq_param[] = {
 };
 #define RT5648_HWEQ_LEN ARRAY_SIZE(hweq_param)
 
-int eqreg[EQ_CH_NUM][EQ_REG_NUM] = {
+static const int eqreg[EQ_CH_NUM][EQ_REG_NUM] = {
 	{0xa4, 0xa5, 0xeb, 0xec, 0xed, 0xee, 0xe7, 0xe8, 0xe9, 0xea, 0xe5, 
 	 0xe6, 0xae, 0xaf, 0xb0, 0xb4, 0xb5, 0xb6, 0xba, 0xbb, 0xbc, 0xc0,
 	 0xc1, 0xc4, 0xc5, 0xc6, 0xca, 0xcc,
 	 0xa6, 0xa7, 0xf5, 0xf6, 0xf7, 0xf8, 0xf1, 0xf2, 0xf3, 0xf4, 0xef,
 	 0xf0, 0xb1, 0xb2, 0xb3, 0xb7, 0xb8, 0xb9, 0xbd, 0xbe, 0xbf, 0xc2,
 	 0xc3, 0xc7, 0xc8, 0xc9, 0xcb, 0xcd},
+	/* DACR shares the DACL row, its words are the second half */
+	{0},
 	{0xce, 0xcf, 0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8,
 	 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xe1, 0xe2},
 };
 
-int rt5648_update_eqmode(
-	struct snd_soc_codec *codec, int channel, int mode)
+static const unsigned int eq_ctrl_mask[EQ_CH_NUM] = {
+	[EQ_CH_DACL] = 0x33fe,
+	[EQ_CH_DACR] = 0x33fe,
+	[EQ_CH_ADC] = 0x01bf,
+};
+
+#define RT5648_EQ_GEN_CACHE	8
+
+/* EQ state of one codec, everything but the work item under lock */
+struct rt5648_eq {
+	struct mutex lock;
+
+	/* presets loaded from RT5648_EQ_FW_NAME */
+	struct rt5648_eq_preset *fw_preset;
+	int fw_num;
+	struct completion fw_done; /* no request in flight */
+
+	/*
+	 * What is currently programmed on each channel, so that a mode or
+	 * rate switch only writes the coefficients that differ.  Index
+	 * writes that bypass rt5648_update_eqmode() are not tracked.
+	 */
+	struct {
+		int mode; /* -1 if unknown */
+		unsigned int rate; /* the bank was resolved for */
+		unsigned int value[EQ_REG_NUM];
+		DECLARE_BITMAP(valid, EQ_REG_NUM);
+	} cur[EQ_CH_NUM];
+
+	/* band parameters for RT5648_EQ_USER */
+	struct rt5648_eq_param user_param;
+
+	/* generated presets keyed by (id, channel, param, rate), LRU out */
+	struct {
+		unsigned long used; /* 0 if empty */
+		struct rt5648_eq_param param;
+		struct rt5648_eq_preset preset;
+	} gen_cache[RT5648_EQ_GEN_CACHE];
+	unsigned long gen_stamp;
+	struct rt5648_eq_preset gen_ctrl;
+
+	/* staged switches, see rt5648_queue_eqmode() */
+	int req[EQ_CH_NUM]; /* last mode queued */
+	int pending[EQ_CH_NUM]; /* -1 if none */
+	struct work_struct work;
+	struct completion done;
+	struct snd_kcontrol *busy_kctl;
+	struct snd_soc_codec *codec;
+};
+
+static inline struct rt5648_eq *to_rt5648_eq(struct snd_soc_codec *codec)
 {
-	struct rt_codec_ops *ioctl_ops = rt_codec_get_ioctl_ops();
-	int i, upd_reg, reg, mask;
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+
+	return rt5648->eq;
+}
+
+static int rt5648_eq_coef_num(int channel)
+{
+	int i;
+
+	for (i = 0; i < EQ_REG_NUM && eqreg[channel][i]; i++)
+		;
+	return i;
+}
+
+static int rt5648_eq_fw_parse(struct device *dev, const struct firmware *fw,
+	struct rt5648_eq_preset **table)
+{
+	const struct rt5648_eq_fw_hdr *hdr = (const void *)fw->data;
+	const struct rt5648_eq_fw_preset *fp;
+	struct rt5648_eq_preset *p;
+	size_t pos = sizeof(*hdr), len;
+	int i, j, num;
 
-	if (codec == NULL ||  mode >= RT5648_HWEQ_LEN)
+	if (fw->size < sizeof(*hdr) ||
+		le32_to_cpu(hdr->magic) != RT5648_EQ_FW_MAGIC) {
+		dev_err(dev, "%s: bad EQ profile\n", RT5648_EQ_FW_NAME);
 		return -EINVAL;
+	}
+	if (le16_to_cpu(hdr->version) != RT5648_EQ_FW_VERSION) {
+		dev_err(dev, "%s: unsupported version %u\n", RT5648_EQ_FW_NAME,
+			le16_to_cpu(hdr->version));
+		return -EINVAL;
+	}
 
-	dev_dbg(codec->dev, "%s(): mode=%d\n", __func__, mode);
-	if (mode != NORMAL) {
-		for(i = 0; i < EQ_REG_NUM; i++) {
-			hweq_param[mode].reg[i] = eqreg[channel][i];
-		}
+	num = le16_to_cpu(hdr->num_presets);
+	p = kcalloc(num, sizeof(*p), GFP_KERNEL);
+	if (p == NULL)
+		return -ENOMEM;
 
-		for(i = 0; i < EQ_REG_NUM; i++) {
-			if(hweq_param[mode].reg[i])
-				ioctl_ops->index_write(codec, hweq_param[mode].reg[i],
-						hweq_param[mode].value[i]);
-			else
-				break;
+	for (i = 0; i < num; i++) {
+		fp = (const void *)(fw->data + pos);
+		if (fw->size - pos < sizeof(*fp))
+			goto err;
+		len = sizeof(*fp) + le16_to_cpu(fp->num_coef) * sizeof(__le16);
+		if (fw->size - pos < len)
+			goto err;
+
+		memcpy(p[i].name, fp->name, RT5648_EQ_NAME_LEN);
+		p[i].name[RT5648_EQ_NAME_LEN - 1] = '\0';
+		p[i].id = le16_to_cpu(fp->id);
+		p[i].channel = le16_to_cpu(fp->channel);
+		p[i].rate = le32_to_cpu(fp->rate);
+		p[i].num_coef = le16_to_cpu(fp->num_coef);
+		if (p[i].channel >= EQ_CH_NUM ||
+			p[i].num_coef > rt5648_eq_coef_num(p[i].channel))
+			goto err;
+		p[i].mask = le16_to_cpu(fp->mask) & eq_ctrl_mask[p[i].channel];
+		p[i].ctrl = le16_to_cpu(fp->ctrl) & p[i].mask;
+		for (j = 0; j < p[i].num_coef; j++)
+			p[i].coef[j] = le16_to_cpu(fp->coef[j]);
+		pos += len;
+	}
+
+	*table = p;
+	return num;
+
+err:
+	dev_err(dev, "%s: preset %d is malformed\n", RT5648_EQ_FW_NAME, i);
+	kfree(p);
+	return -EINVAL;
+}
+
+static void rt5648_eq_fw_loaded(const struct firmware *fw, void *context)
+{
+	struct snd_soc_codec *codec = context;
+	struct rt5648_eq *eq = to_rt5648_eq(codec);
+	struct rt5648_eq_preset *table, *old;
+	int num, ch;
+
+	if (fw == NULL) {
+		dev_dbg(codec->dev, "no %s, using built-in EQ presets\n",
+			RT5648_EQ_FW_NAME);
+		goto out;
+	}
+
+	num = rt5648_eq_fw_parse(codec->dev, fw, &table);
+	release_firmware(fw);
+	if (num < 0)
+		goto out;
+
+	mutex_lock(&eq->lock);
+	old = eq->fw_preset;
+	eq->fw_preset = table;
+	eq->fw_num = num;
+	/* make the next update re-resolve the preset, the diff stays cheap */
+	for (ch = 0; ch < EQ_CH_NUM; ch++)
+		eq->cur[ch].mode = -1;
+	mutex_unlock(&eq->lock);
+	kfree(old);
+
+	dev_info(codec->dev, "loaded %d EQ presets from %s\n", num,
+		RT5648_EQ_FW_NAME);
+out:
+	complete_all(&eq->fw_done);
+}
+
+void rt5648_eq_fw_request(struct snd_soc_codec *codec)
+{
+	struct rt5648_eq *eq = to_rt5648_eq(codec);
+	int ret;
+
+	reinit_completion(&eq->fw_done);
+	ret = request_firmware_nowait(THIS_MODULE, FW_ACTION_HOTPLUG,
+		RT5648_EQ_FW_NAME, codec->dev, GFP_KERNEL, codec,
+		rt5648_eq_fw_loaded);
+	if (ret < 0) {
+		dev_warn(codec->dev, "Failed to request %s: %d\n",
+			RT5648_EQ_FW_NAME, ret);
+		complete_all(&eq->fw_done);
+	}
+}
+
+/* Waits for an outstanding request, its callback uses eq and codec. */
+void rt5648_eq_fw_release(struct snd_soc_codec *codec)
+{
+	struct rt5648_eq *eq = to_rt5648_eq(codec);
+
+	wait_for_completion(&eq->fw_done);
+	mutex_lock(&eq->lock);
+	kfree(eq->fw_preset);
+	eq->fw_preset = NULL;
+	eq->fw_num = 0;
+	mutex_unlock(&eq->lock);
+}
+
+/* Caller holds eq->lock. */
+static const struct rt5648_eq_preset *rt5648_eq_fw_find(struct rt5648_eq *eq,
+	int channel, int mode, unsigned int rate)
+{
+	const struct rt5648_eq_preset *any = NULL;
+	int i;
+
+	for (i = 0; i < eq->fw_num; i++) {
+		if (eq->fw_preset[i].id != mode ||
+			eq->fw_preset[i].channel != channel)
+			continue;
+		if (eq->fw_preset[i].rate == rate)
+			return &eq->fw_preset[i];
+		if (eq->fw_preset[i].rate == 0)
+			any = &eq->fw_preset[i];
+	}
+
+	return any;
+}
+
+/*
+ * Parametric EQ generator.
+ *
+ * Each EQ section is a Regalia-Mitra allpass whose output is mixed back
+ * in with gain H0 = V0 - 1, V0 = 10^(G/20).  Coefficients are signed
+ * Q2.13 words (0x2000 = 1.0), the pre/post volumes Q5.11 (0x0800 = 0 dB).
+ * A 28 word half of eqreg[EQ_CH_DACL] holds
+ *
+ *	 0- 1	LPF1 first order low shelf	a, H0
+ *	 2-11	BPF1				not generated
+ *	12-20	BPF2-4 peaking, 3 words each	-(1 + k2)cos(w0), k2, H0
+ *	21-22	HPF1 first order high shelf	a, H0
+ *	23-25	HPF2				not generated
+ *	26-27	pre and post volume
+ *
+ * and the 18 words of eqreg[EQ_CH_ADC]
+ *
+ *	 0- 1	LPF low shelf
+ *	 2-13	BPF1-4 peaking
+ *	14-15	HPF1 high shelf
+ *	16-17	pre and post volume
+ *
+ * with a, k2 = (1 - t) / (1 + t) when boosting and (V0 - t) / (V0 + t)
+ * when cutting, t = tan(w0 / 2) for the shelves and tan(w0 / 2Q) for a
+ * peak.  The high shelf cuts with (1 - V0 t) / (1 + V0 t).  This layout
+ * is the RT5640 family one and agrees with the words in hweq_param[].
+ */
+static const struct rt5648_eq_layout {
+	int half;		/* words per side, 0 if none */
+	int sides;
+	int lpf1, bpf, bpf_num, hpf1, vol;
+	unsigned int lpf1_en, bpf_en, hpf1_en;
+} rt5648_eq_layout[EQ_CH_NUM] = {
+	[EQ_CH_DACL] = {
+		28, 2, 0, 12, 3, 21, 26,
+		/* CLUB turns its bass shelf on with the mode bit alone */
+		RT5648_EQ_LPF1_M_1ST, RT5648_EQ_BPF2_EN,
+		RT5648_EQ_HPF1_EN | RT5648_EQ_HPF1_M_HI,
+	},
+	[EQ_CH_ADC] = {
+		18, 1, 0, 2, 4, 14, 16,
+		RT5648_EQ_LPF_EN, RT5648_EQ_BPF1_EN,
+		RT5648_EQ_HPF1_EN | RT5648_EQ_HPF1_M_HI,
+	},
+};
+
+/* sin() over a quarter turn in 64 steps, Q15 */
+static const u16 rt5648_eq_sin_tab[65] = {
+	0, 804, 1608, 2411, 3212, 4011, 4808, 5602, 6393, 7180, 7962,
+	8740, 9512, 10279, 11039, 11793, 12540, 13279, 14010, 14733, 15447,
+	16151, 16846, 17531, 18205, 18868, 19520, 20160, 20788, 21403, 22006,
+	22595, 23170, 23732, 24279, 24812, 25330, 25833, 26320, 26791, 27246,
+	27684, 28106, 28511, 28899, 29269, 29622, 29957, 30274, 30572, 30853,
+	31114, 31357, 31581, 31786, 31972, 32138, 32286, 32413, 32522, 32610,
+	32679, 32729, 32758, 32768,
+};
+
+/* 10^(n / 20) for whole dB and 10^(n / 200) for tenths, Q16 */
+static const u32 rt5648_eq_db_tab[] = {
+	65536, 73533, 82505, 92572, 103868, 116541, 130762, 146717, 164619,
+	184706, 207243, 232531, 260904, 292739, 328458, 368536, 413504,
+	463959, 520571, 584090, 655360, 735326, 825049, 925721, 1038676,
+};
+
+static const u32 rt5648_eq_db10_tab[] = {
+	65536, 66295, 67063, 67839, 68625, 69419, 70223, 71036, 71859, 72691,
+};
+
+/* Built-in parametric presets, generated for the rate in use */
+static const struct {
+	int id;
+	int channel;
+	const char *name;
+	struct rt5648_eq_param param;
+} rt5648_eq_param_preset[] = {
+	{
+		/* rumble and pop high-pass, presence lift */
+		RT5648_EQ_VOICE, EQ_CH_ADC, "voice", {
+			.band = {
+				{ RT5648_EQ_BAND_LOW_SHELF, 120, 71, -120 },
+				{ RT5648_EQ_BAND_PEAK, 3000, 90, 40 },
+			},
+		},
+	},
+	{
+		/* as voice, plus room boom cut and pre-emphasis */
+		RT5648_EQ_FAR_FIELD, EQ_CH_ADC, "far-field", {
+			.band = {
+				{ RT5648_EQ_BAND_LOW_SHELF, 200, 71, -120 },
+				{ RT5648_EQ_BAND_PEAK, 400, 100, -30 },
+				{ RT5648_EQ_BAND_PEAK, 3500, 80, 60 },
+				{ RT5648_EQ_BAND_HIGH_SHELF, 6000, 71, 40 },
+			},
+			.post_gain = 30,
+		},
+	},
+};
+
+/* sin(2 pi phase / 0x10000), Q15 */
+static int rt5648_eq_sin(u32 phase)
+{
+	int neg = phase & 0x8000, i, v;
+
+	phase &= 0x7fff;
+	if (phase > 0x4000)
+		phase = 0x8000 - phase;
+	i = phase >> 8;
+	v = rt5648_eq_sin_tab[i];
+	if (i < 64)
+		v += ((rt5648_eq_sin_tab[i + 1] - v) * (int)(phase & 0xff)) >> 8;
+
+	return neg ? -v : v;
+}
+
+static int rt5648_eq_cos(u32 phase)
+{
+	return rt5648_eq_sin(phase + 0x4000);
+}
+
+/* tan() of a phase short of a quarter turn, Q15 */
+static s64 rt5648_eq_tan(u32 phase)
+{
+	phase = min_t(u32, phase, 0x3f00);
+
+	return div_s64((s64)rt5648_eq_sin(phase) << 15, rt5648_eq_cos(phase));
+}
+
+/* 10^(gain / 200), gain in 0.1 dB, Q16 */
+static u32 rt5648_eq_db_to_lin(int gain)
+{
+	unsigned int g = min(abs(gain), RT5648_EQ_GAIN_MAX);
+	u32 v;
+
+	v = ((u64)rt5648_eq_db_tab[g / 10] * rt5648_eq_db10_tab[g % 10]) >> 16;
+
+	return gain < 0 ? div_u64(1ULL << 32, v) : v;
+}
+
+static unsigned int rt5648_eq_word(s64 v)
+{
+	return clamp_t(s64, v, -0x8000, 0x7fff) & 0xffff;
+}
+
+/* (g - t) / (g + t) in Q13, g and t in Q15 */
+static s64 rt5648_eq_allpass(s64 g, s64 t)
+{
+	return div_s64((g - t) << 13, g + t);
+}
+
+/* phase of freq at rate, 0x10000 being a full turn */
+static u32 rt5648_eq_phase(int freq, unsigned int rate)
+{
+	freq = min_t(unsigned int, freq, rate * 9 / 20);
+
+	return div_u64((u64)freq << 16, rate);
+}
+
+static void rt5648_eq_shelf(unsigned int *w, const struct rt5648_eq_band *b,
+	unsigned int rate, bool high)
+{
+	s64 v0 = rt5648_eq_db_to_lin(b->gain);
+	s64 t = rt5648_eq_tan(rt5648_eq_phase(b->freq, rate) / 2);
+
+	if (b->gain >= 0)
+		w[0] = rt5648_eq_word(rt5648_eq_allpass(1 << 15, t));
+	else if (high)
+		w[0] = rt5648_eq_word(rt5648_eq_allpass(1 << 15,
+			(v0 * t) >> 16));
+	else
+		w[0] = rt5648_eq_word(rt5648_eq_allpass(v0 >> 1, t));
+	w[1] = rt5648_eq_word((v0 - 0x10000) >> 3);
+}
+
+static void rt5648_eq_peak(unsigned int *w, const struct rt5648_eq_band *b,
+	unsigned int rate)
+{
+	u32 w0 = rt5648_eq_phase(b->freq, rate);
+	s64 v0 = rt5648_eq_db_to_lin(b->gain);
+	s64 t = rt5648_eq_tan(div_u64((u64)w0 * 50, b->q));
+	s64 k2;
+
+	k2 = rt5648_eq_allpass(b->gain >= 0 ? 1 << 15 : v0 >> 1, t);
+	w[0] = rt5648_eq_word(-(((1 << 13) + k2) * rt5648_eq_cos(w0)) >> 15);
+	w[1] = rt5648_eq_word(k2);
+	w[2] = rt5648_eq_word((v0 - 0x10000) >> 3);
+}
+
+static void rt5648_eq_generate(const struct rt5648_eq_param *p,
+	int id, int channel, const char *name, unsigned int rate,
+	struct rt5648_eq_preset *out)
+{
+	const struct rt5648_eq_layout *l = &rt5648_eq_layout[channel];
+	unsigned int *w = out->coef;
+	int i, peak = 0;
+
+	memset(out, 0, sizeof(*out));
+	strlcpy(out->name, name, sizeof(out->name));
+	out->id = id;
+	out->channel = channel;
+	out->rate = rate;
+	out->mask = eq_ctrl_mask[channel];
+
+	for (i = 0; i < RT5648_EQ_BANDS; i++) {
+		const struct rt5648_eq_band *b = &p->band[i];
+
+		switch (b->type) {
+		case RT5648_EQ_BAND_LOW_SHELF:
+			rt5648_eq_shelf(w + l->lpf1, b, rate, false);
+			out->ctrl |= l->lpf1_en;
+			break;
+		case RT5648_EQ_BAND_PEAK:
+			rt5648_eq_peak(w + l->bpf + 3 * peak, b, rate);
+			out->ctrl |= l->bpf_en << peak;
+			peak++;
+			break;
+		case RT5648_EQ_BAND_HIGH_SHELF:
+			rt5648_eq_shelf(w + l->hpf1, b, rate, true);
+			out->ctrl |= l->hpf1_en;
+			break;
+		default:
+			break;
 		}
 	}
+	w[l->vol] = rt5648_eq_db_to_lin(p->pre_gain) >> 5;
+	w[l->vol + 1] = rt5648_eq_db_to_lin(p->post_gain) >> 5;
+
+	for (i = 1; i < l->sides; i++)
+		memcpy(w + i * l->half, w, l->half * sizeof(*w));
+	out->num_coef = l->sides * l->half;
+}
+
+static int rt5648_eq_param_check(const struct rt5648_eq_param *p,
+	int channel)
+{
+	int i, num[RT5648_EQ_BAND_TYPES] = {0};
+
+	if (abs(p->pre_gain) > RT5648_EQ_GAIN_MAX ||
+		abs(p->post_gain) > RT5648_EQ_GAIN_MAX)
+		return -EINVAL;
+
+	for (i = 0; i < RT5648_EQ_BANDS; i++) {
+		const struct rt5648_eq_band *b = &p->band[i];
+
+		if (b->type < 0 || b->type >= RT5648_EQ_BAND_TYPES ||
+			b->freq < 20 || b->freq > 20000 ||
+			b->q < RT5648_EQ_Q_MIN || b->q > RT5648_EQ_Q_MAX ||
+			abs(b->gain) > RT5648_EQ_GAIN_MAX)
+			return -EINVAL;
+		num[b->type]++;
+	}
+
+	/* one section of each shelf, the peaking ones as laid out */
+	if (num[RT5648_EQ_BAND_LOW_SHELF] > 1 ||
+		num[RT5648_EQ_BAND_HIGH_SHELF] > 1 ||
+		num[RT5648_EQ_BAND_PEAK] > rt5648_eq_layout[channel].bpf_num)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* Caller holds eq->lock. */
+static const struct rt5648_eq_preset *rt5648_eq_gen_find(
+	struct rt5648_eq *eq, int channel, int id, const char *name,
+	const struct rt5648_eq_param *p, unsigned int rate)
+{
+	int i, lru = 0, gen_ch = channel == EQ_CH_DACR ? EQ_CH_DACL : channel;
+	struct rt5648_eq_preset *preset;
+
+	if (rate == 0)
+		rate = 48000;
+
+	for (i = 0; i < RT5648_EQ_GEN_CACHE; i++) {
+		preset = &eq->gen_cache[i].preset;
+		if (eq->gen_cache[i].used && preset->id == id &&
+			preset->channel == gen_ch && preset->rate == rate &&
+			!memcmp(&eq->gen_cache[i].param, p, sizeof(*p)))
+			goto found;
+		if (eq->gen_cache[i].used < eq->gen_cache[lru].used)
+			lru = i;
+	}
+
+	i = lru;
+	preset = &eq->gen_cache[i].preset;
+	eq->gen_cache[i].param = *p;
+	rt5648_eq_generate(p, id, gen_ch, name, rate, preset);
+
+found:
+	eq->gen_cache[i].used = ++eq->gen_stamp;
+	if (channel == gen_ch)
+		return preset;
+
+	/* EQ_CTRL2 is shared, DACR only restates the enables */
+	eq->gen_ctrl = *preset;
+	eq->gen_ctrl.channel = channel;
+	eq->gen_ctrl.num_coef = 0;
+	return &eq->gen_ctrl;
+}
+
+/* Caller holds eq->lock. */
+static const struct rt5648_eq_preset *rt5648_eq_param_find(
+	struct rt5648_eq *eq, int channel, int mode, unsigned int rate)
+{
+	int i;
+
+	if (mode == RT5648_EQ_USER)
+		return channel == EQ_CH_ADC ? NULL : rt5648_eq_gen_find(eq,
+			channel, mode, "user", &eq->user_param, rate);
+
+	for (i = 0; i < ARRAY_SIZE(rt5648_eq_param_preset); i++)
+		if (rt5648_eq_param_preset[i].id == mode &&
+			rt5648_eq_param_preset[i].channel == channel)
+			return rt5648_eq_gen_find(eq, channel, mode,
+				rt5648_eq_param_preset[i].name,
+				&rt5648_eq_param_preset[i].param, rate);
+
+	return NULL;
+}
+
+static void rt5648_eq_strobe(struct snd_soc_codec *codec, int upd_reg)
+{
+	snd_soc_update_bits(codec, upd_reg,
+		RT5648_EQ_UPD, RT5648_EQ_UPD);
+	snd_soc_update_bits(codec, upd_reg, RT5648_EQ_UPD, 0);
+}
+
+/*
+ * Find the bank for mode on channel at rate.  Caller holds eq->lock.
+ * Returns 0 for success or negative error code.
+ */
+static int rt5648_eq_resolve(struct snd_soc_codec *codec,
+	struct rt5648_eq *eq, int channel, int mode, unsigned int rate,
+	const unsigned int **value, int *num, unsigned int *ctrl,
+	unsigned int *mask)
+{
+	const struct rt5648_eq_preset *preset;
+
+	if (mode == RT5648_EQ_USER)
+		preset = rt5648_eq_param_find(eq, channel, mode, rate);
+	else
+		preset = rt5648_eq_fw_find(eq, channel, mode, rate) ?:
+			rt5648_eq_param_find(eq, channel, mode, rate);
+	if (preset) {
+		*value = preset->coef;
+		*num = preset->num_coef;
+		*ctrl = preset->ctrl;
+		*mask = preset->mask;
+		dev_dbg(codec->dev, "%s(): preset %s\n", __func__,
+			preset->name);
+	} else if (mode < RT5648_HWEQ_LEN &&
+		(channel != EQ_CH_ADC || mode == NORMAL)) {
+		*value = hweq_param[mode].value;
+		*num = mode == NORMAL ? 0 : rt5648_eq_coef_num(channel);
+		*ctrl = hweq_param[mode].ctrl;
+		*mask = eq_ctrl_mask[channel];
+		if (*num && rate && rate != RT5648_HWEQ_RATE)
+			dev_dbg(codec->dev, "%s(): no %uHz bank for mode %d\n",
+				__func__, rate, mode);
+	} else {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Write the coefficient words of channel that differ from value.  They
+ * only reach the running filter on the next EQ_UPD strobe.  Caller holds
+ * eq->lock.
+ */
+static int rt5648_eq_write_coef(struct snd_soc_codec *codec,
+	struct rt5648_eq *eq, int channel, const unsigned int *value, int num)
+{
+	struct rt_codec_ops *ioctl_ops = rt_codec_get_ioctl_ops();
+	unsigned int reg_list[EQ_REG_NUM], val_list[EQ_REG_NUM];
+	int i, n, ret = 0;
+	ktime_t start;
+
+	start = ktime_get();
+	for (i = 0, n = 0; i < num; i++) {
+		if (test_bit(i, eq->cur[channel].valid) &&
+			eq->cur[channel].value[i] == value[i])
+			continue;
+		reg_list[n] = eqreg[channel][i];
+		val_list[n] = value[i];
+		n++;
+	}
+
+	if (ioctl_ops->index_bulk_write) {
+		ret = ioctl_ops->index_bulk_write(codec, reg_list,
+			val_list, n);
+	} else {
+		for (i = 0; i < n && ret >= 0; i++)
+			ret = ioctl_ops->index_write(codec,
+				reg_list[i], val_list[i]);
+	}
+	if (ret < 0) {
+		bitmap_zero(eq->cur[channel].valid, EQ_REG_NUM);
+		eq->cur[channel].mode = -1;
+		return ret;
+	}
+
+	for (i = 0; i < num; i++) {
+		eq->cur[channel].value[i] = value[i];
+		set_bit(i, eq->cur[channel].valid);
+	}
+	dev_dbg(codec->dev, "%s(): %d coefficients in %lld us\n",
+		__func__, n, ktime_us_delta(ktime_get(), start));
+
+	return 0;
+}
+
+/*
+ * The coefficient words are shadowed until EQ_UPD is strobed, but
+ * EQ_CTRL2 takes effect at once.  A staged update therefore stops the
+ * sections the new curve drops, writes the words, latches them into the
+ * sections that keep running and only then enables the new sections, so
+ * nothing ever runs on a half written set.
+ */
+static int __rt5648_update_eqmode(struct snd_soc_codec *codec,
+	int channel, int mode, bool staged)
+{
+	struct rt5648_priv *rt5648;
+	struct rt5648_eq *eq;
+	const unsigned int *value;
+	unsigned int ctrl, mask, rate;
+	int num, ret, upd_reg, reg;
+
+	if (codec == NULL || mode < 0 || channel < 0 || channel >= EQ_CH_NUM)
+		return -EINVAL;
+	rt5648 = snd_soc_codec_get_drvdata(codec);
+	eq = rt5648->eq;
+	rate = rt5648->lrck[RT5648_AIF1];
+
+	dev_dbg(codec->dev, "%s(): mode=%d rate=%u\n", __func__, mode, rate);
+	mutex_lock(&eq->lock);
+	ret = 0;
+	if (eq->cur[channel].mode == mode && eq->cur[channel].rate == rate)
+		goto out;
+
+	ret = rt5648_eq_resolve(codec, eq, channel, mode, rate, &value, &num,
+		&ctrl, &mask);
+	if (ret < 0)
+		goto out;
+
 	switch (channel) {
 	case EQ_CH_DACL:
 	case EQ_CH_DACR:
 		reg = RT5648_EQ_CTRL2;
-		mask = 0x33fe;
 		upd_reg = RT5648_EQ_CTRL1;
 		break;
 	case EQ_CH_ADC:
+	default:
 		reg = RT5648_ADC_EQ_CTRL2;
-		mask = 0x01bf;
 		upd_reg = RT5648_ADC_EQ_CTRL1;
 		break;
-	default:
-		printk("Invalid EQ channel\n");
+	}
+	if (staged)
+		snd_soc_update_bits(codec, reg, mask & ~ctrl, 0);
+
+	if (num) {
+		ret = rt5648_eq_write_coef(codec, eq, channel, value, num);
+		if (ret < 0)
+			goto out;
+	}
+	if (staged)
+		rt5648_eq_strobe(codec, upd_reg);
+	snd_soc_update_bits(codec, reg, mask, ctrl);
+	rt5648_eq_strobe(codec, upd_reg);
+	eq->cur[channel].mode = mode;
+	eq->cur[channel].rate = rate;
+
+out:
+	mutex_unlock(&eq->lock);
+	return ret;
+}
+
+/*
+ * Write the words of mode's bank for the current AIF1 rate without
+ * strobing them or touching the enables, so that the PMU event which
+ * later switches the EQ on has nothing left to upload.  What is running
+ * keeps running on the latched set.
+ */
+int rt5648_preload_eqmode(struct snd_soc_codec *codec, int channel, int mode)
+{
+	struct rt5648_priv *rt5648;
+	struct rt5648_eq *eq;
+	const unsigned int *value;
+	unsigned int ctrl, mask;
+	int num, ret;
+
+	if (codec == NULL || mode < 0 || channel < 0 || channel >= EQ_CH_NUM)
+		return -EINVAL;
+	rt5648 = snd_soc_codec_get_drvdata(codec);
+	eq = rt5648->eq;
+
+	mutex_lock(&eq->lock);
+	ret = rt5648_eq_resolve(codec, eq, channel, mode,
+		rt5648->lrck[RT5648_AIF1], &value, &num, &ctrl, &mask);
+	if (ret == 0 && num)
+		ret = rt5648_eq_write_coef(codec, eq, channel, value, num);
+	mutex_unlock(&eq->lock);
+
+	return ret;
+}
+
+int rt5648_update_eqmode(
+	struct snd_soc_codec *codec, int channel, int mode)
+{
+	return __rt5648_update_eqmode(codec, channel, mode, false);
+}
+
+/*
+ * Whether mode names a built-in bank, a built-in or firmware preset or
+ * RT5648_EQ_USER for channel, at any rate.  Caller holds eq->lock.
+ */
+static bool rt5648_eq_mode_valid(struct rt5648_eq *eq, int channel, int mode)
+{
+	int i;
+
+	if (mode == RT5648_EQ_USER)
+		return channel != EQ_CH_ADC;
+	if (mode < RT5648_HWEQ_LEN && (channel != EQ_CH_ADC || mode == NORMAL))
+		return true;
+	for (i = 0; i < ARRAY_SIZE(rt5648_eq_param_preset); i++)
+		if (rt5648_eq_param_preset[i].id == mode &&
+			rt5648_eq_param_preset[i].channel == channel)
+			return true;
+	for (i = 0; i < eq->fw_num; i++)
+		if (eq->fw_preset[i].id == mode &&
+			eq->fw_preset[i].channel == channel)
+			return true;
+
+	return false;
+}
+
+/*
+ * Queue a staged switch of channel to mode and return at once.  "EQ
+ * Update Pending" reads 1 until every queued switch has been applied and
+ * is notified when it drops back to 0.
+ */
+int rt5648_queue_eqmode(struct snd_soc_codec *codec, int channel, int mode)
+{
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+	struct rt5648_eq *eq = rt5648->eq;
+
+	if (mode < 0 || channel < 0 || channel >= EQ_CH_NUM)
+		return -EINVAL;
+
+	mutex_lock(&eq->lock);
+	if (!rt5648_eq_mode_valid(eq, channel, mode)) {
+		mutex_unlock(&eq->lock);
 		return -EINVAL;
 	}
-	snd_soc_update_bits(codec, reg, mask, hweq_param[mode].ctrl);
-	snd_soc_update_bits(codec, upd_reg,
-		RT5648_EQ_UPD, RT5648_EQ_UPD);
-	snd_soc_update_bits(codec, upd_reg, RT5648_EQ_UPD, 0);
+	if (channel == EQ_CH_ADC)
+		rt5648->adc_eq_mode = mode;
+	else
+		rt5648->eq_mode = mode;
+	eq->req[channel] = mode;
+	eq->pending[channel] = mode;
+	reinit_completion(&eq->done);
+	mutex_unlock(&eq->lock);
 
+	schedule_work(&eq->work);
 	return 0;
 }
 
-int rt5648_ioctl_common(struct snd_hwdep *hw, struct file *file,
-			unsigned int cmd, unsigned long arg)
+static void rt5648_eq_work(struct work_struct *work)
 {
-	struct snd_soc_codec *codec = hw->private_data;
-	struct rt_codec_cmd __user *_rt_codec = (struct rt_codec_cmd *)arg;
-	struct rt_codec_cmd rt_codec;
-	//struct rt_codec_ops *ioctl_ops = rt_codec_get_ioctl_ops();
-	int *buf;
-	static int eq_mode[EQ_CH_NUM];
+	struct rt5648_eq *eq = container_of(work, struct rt5648_eq, work);
+	struct snd_soc_codec *codec = eq->codec;
+	int ch, mode, ret;
+
+	for (;;) {
+		mutex_lock(&eq->lock);
+		for (ch = 0; ch < EQ_CH_NUM; ch++)
+			if (eq->pending[ch] >= 0)
+				break;
+		if (ch == EQ_CH_NUM) {
+			complete_all(&eq->done);
+			mutex_unlock(&eq->lock);
+			break;
+		}
+		mode = eq->pending[ch];
+		eq->pending[ch] = -1;
+		mutex_unlock(&eq->lock);
 
-	if (copy_from_user(&rt_codec, _rt_codec, sizeof(rt_codec))) {
-		dev_err(codec->dev,"copy_from_user faild\n");
-		return -EFAULT;
+		ret = __rt5648_update_eqmode(codec, ch, mode, true);
+		if (ret < 0)
+			dev_err(codec->dev, "Failed to set EQ mode %d on %d: %d\n",
+				mode, ch, ret);
 	}
-	dev_dbg(codec->dev, "%s(): rt_codec.number=%zu, cmd=%u\n",
-			__func__, rt_codec.number, cmd);
-	buf = kmalloc(sizeof(*buf) * rt_codec.number, GFP_KERNEL);
-	if (buf == NULL)
+
+	if (eq->busy_kctl)
+		snd_ctl_notify(codec->component.card->snd_card,
+			SNDRV_CTL_EVENT_MASK_VALUE, &eq->busy_kctl->id);
+}
+
+int rt5648_eq_init(struct snd_soc_codec *codec)
+{
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+	struct rt5648_eq *eq;
+	int i;
+
+	eq = devm_kzalloc(codec->dev, sizeof(*eq), GFP_KERNEL);
+	if (eq == NULL)
 		return -ENOMEM;
-	if (copy_from_user(buf, rt_codec.buf, sizeof(*buf) * rt_codec.number)) {
-		goto err;
+
+	mutex_init(&eq->lock);
+	for (i = 0; i < EQ_CH_NUM; i++) {
+		eq->cur[i].mode = -1;
+		eq->req[i] = -1;
+		eq->pending[i] = -1;
+	}
+	for (i = 0; i < RT5648_EQ_BANDS; i++) {
+		eq->user_param.band[i].freq = 1000;
+		eq->user_param.band[i].q = 71;
 	}
-	
+	INIT_WORK(&eq->work, rt5648_eq_work);
+	init_completion(&eq->done);
+	complete_all(&eq->done);
+	init_completion(&eq->fw_done);
+	complete_all(&eq->fw_done);
+	eq->codec = codec;
+	rt5648->eq = eq;
+
+	return 0;
+}
+
+void rt5648_eq_exit(struct snd_soc_codec *codec)
+{
+	cancel_work_sync(&to_rt5648_eq(codec)->work);
+}
+
+/*
+ * Queue a switch of the DAC EQ to coefficients generated from p.  A curve
+ * seen before at the current rate comes out of the cache.
+ */
+static int rt5648_eq_set_param(struct snd_soc_codec *codec,
+	const struct rt5648_eq_param *p)
+{
+	struct rt5648_eq *eq = to_rt5648_eq(codec);
+	int ret;
+
+	ret = rt5648_eq_param_check(p, EQ_CH_DACL);
+	if (ret < 0)
+		return ret;
+
+	mutex_lock(&eq->lock);
+	eq->user_param = *p;
+	eq->cur[EQ_CH_DACL].mode = -1;
+	eq->cur[EQ_CH_DACR].mode = -1;
+	mutex_unlock(&eq->lock);
+
+	rt5648_queue_eqmode(codec, EQ_CH_DACL, RT5648_EQ_USER);
+	return rt5648_queue_eqmode(codec, EQ_CH_DACR, RT5648_EQ_USER);
+}
+
+static void rt5648_eq_get_param(struct snd_soc_codec *codec,
+	struct rt5648_eq_param *p)
+{
+	struct rt5648_eq *eq = to_rt5648_eq(codec);
+
+	mutex_lock(&eq->lock);
+	*p = eq->user_param;
+	mutex_unlock(&eq->lock);
+}
+
+enum {
+	RT5648_EQ_FIELD_TYPE,
+	RT5648_EQ_FIELD_FREQ,
+	RT5648_EQ_FIELD_Q,
+	RT5648_EQ_FIELD_GAIN,
+};
+
+/* band RT5648_EQ_BANDS addresses the pre (field 0) and post volume */
+static int *rt5648_eq_field(struct rt5648_eq_param *p, int band, int field)
+{
+	if (band == RT5648_EQ_BANDS)
+		return field ? &p->post_gain : &p->pre_gain;
+
+	switch (field) {
+	case RT5648_EQ_FIELD_TYPE:
+		return &p->band[band].type;
+	case RT5648_EQ_FIELD_FREQ:
+		return &p->band[band].freq;
+	case RT5648_EQ_FIELD_Q:
+		return &p->band[band].q;
+	default:
+		return &p->band[band].gain;
+	}
+}
+
+/* gains are offset by RT5648_EQ_GAIN_MAX to keep the control unsigned */
+static int rt5648_eq_field_offset(int band, int field)
+{
+	if (band == RT5648_EQ_BANDS || field == RT5648_EQ_FIELD_GAIN)
+		return RT5648_EQ_GAIN_MAX;
+
+	return 0;
+}
+
+static int rt5648_eq_ctl_get(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_soc_codec *codec = snd_kcontrol_chip(kcontrol);
+	struct soc_mixer_control *mc =
+		(struct soc_mixer_control *)kcontrol->private_value;
+	struct rt5648_eq_param p;
+
+	rt5648_eq_get_param(codec, &p);
+	ucontrol->value.integer.value[0] = *rt5648_eq_field(&p, mc->reg,
+		mc->shift) + rt5648_eq_field_offset(mc->reg, mc->shift);
+
+	return 0;
+}
+
+static int rt5648_eq_ctl_put(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_soc_codec *codec = snd_kcontrol_chip(kcontrol);
+	struct soc_mixer_control *mc =
+		(struct soc_mixer_control *)kcontrol->private_value;
+	struct rt5648_eq_param p;
+	int *field, val, ret;
+
+	if (ucontrol->value.integer.value[0] < 0 ||
+		ucontrol->value.integer.value[0] > mc->max)
+		return -EINVAL;
+	val = ucontrol->value.integer.value[0] -
+		rt5648_eq_field_offset(mc->reg, mc->shift);
+
+	rt5648_eq_get_param(codec, &p);
+	field = rt5648_eq_field(&p, mc->reg, mc->shift);
+	if (*field == val)
+		return 0;
+	*field = val;
+
+	ret = rt5648_eq_set_param(codec, &p);
+
+	return ret < 0 ? ret : 1;
+}
+
+#define RT5648_EQ_CTL(xname, band, field, max) \
+	SOC_SINGLE_EXT(xname, band, field, max, 0, \
+		rt5648_eq_ctl_get, rt5648_eq_ctl_put)
+
+#define RT5648_EQ_BAND_CTLS(n) \
+	RT5648_EQ_CTL("EQ Band" #n " Type", n - 1, RT5648_EQ_FIELD_TYPE, \
+		RT5648_EQ_BAND_TYPES - 1), \
+	RT5648_EQ_CTL("EQ Band" #n " Freq", n - 1, RT5648_EQ_FIELD_FREQ, \
+		20000), \
+	RT5648_EQ_CTL("EQ Band" #n " Q", n - 1, RT5648_EQ_FIELD_Q, \
+		RT5648_EQ_Q_MAX), \
+	RT5648_EQ_CTL("EQ Band" #n " Gain", n - 1, RT5648_EQ_FIELD_GAIN, \
+		2 * RT5648_EQ_GAIN_MAX)
+
+static const char * const rt5648_adc_eq_text[] = {
+	"Off", "Voice", "Far Field",
+};
+
+static const int rt5648_adc_eq_mode[] = {
+	NORMAL, RT5648_EQ_VOICE, RT5648_EQ_FAR_FIELD,
+};
+
+static const SOC_ENUM_SINGLE_EXT_DECL(rt5648_adc_eq_enum, rt5648_adc_eq_text);
+
+static int rt5648_adc_eq_get(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_soc_codec *codec = snd_kcontrol_chip(kcontrol);
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+	int i;
+
+	ucontrol->value.enumerated.item[0] = 0;
+	for (i = 0; i < ARRAY_SIZE(rt5648_adc_eq_mode); i++)
+		if (rt5648_adc_eq_mode[i] == rt5648->adc_eq_mode)
+			ucontrol->value.enumerated.item[0] = i;
+
+	return 0;
+}
+
+static int rt5648_adc_eq_put(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_soc_codec *codec = snd_kcontrol_chip(kcontrol);
+	struct rt5648_priv *rt5648 = snd_soc_codec_get_drvdata(codec);
+	unsigned int item = ucontrol->value.enumerated.item[0];
+	int ret;
+
+	if (item >= ARRAY_SIZE(rt5648_adc_eq_mode))
+		return -EINVAL;
+	if (rt5648->adc_eq_mode == rt5648_adc_eq_mode[item])
+		return 0;
+
+	ret = rt5648_queue_eqmode(codec, EQ_CH_ADC, rt5648_adc_eq_mode[item]);
+
+	return ret < 0 ? ret : 1;
+}
+
+static int rt5648_eq_busy_get(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	struct snd_soc_codec *codec = snd_kcontrol_chip(kcontrol);
+
+	ucontrol->value.integer.value[0] =
+		!completion_done(&to_rt5648_eq(codec)->done);
+
+	return 0;
+}
+
+/* Changing any of the band controls switches the DAC EQ to RT5648_EQ_USER. */
+static const struct snd_kcontrol_new rt5648_eq_controls[] = {
+	RT5648_EQ_BAND_CTLS(1),
+	RT5648_EQ_BAND_CTLS(2),
+	RT5648_EQ_BAND_CTLS(3),
+	RT5648_EQ_BAND_CTLS(4),
+	RT5648_EQ_BAND_CTLS(5),
+	RT5648_EQ_CTL("EQ Pre Gain", RT5648_EQ_BANDS, 0,
+		2 * RT5648_EQ_GAIN_MAX),
+	RT5648_EQ_CTL("EQ Post Gain", RT5648_EQ_BANDS, 1,
+		2 * RT5648_EQ_GAIN_MAX),
+	SOC_ENUM_EXT("ADC EQ Mode", rt5648_adc_eq_enum,
+		rt5648_adc_eq_get, rt5648_adc_eq_put),
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.name = "EQ Update Pending",
+		.access = SNDRV_CTL_ELEM_ACCESS_READ |
+			SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+		.info = snd_ctl_boolean_mono_info,
+		.get = rt5648_eq_busy_get,
+	},
+};
+
+int rt5648_eq_add_controls(struct snd_soc_codec *codec)
+{
+	int ret;
+
+	ret = snd_soc_add_codec_controls(codec, rt5648_eq_controls,
+		ARRAY_SIZE(rt5648_eq_controls));
+	if (ret < 0)
+		return ret;
+
+	to_rt5648_eq(codec)->busy_kctl = snd_soc_card_get_kcontrol(
+		codec->component.card, "EQ Update Pending");
+	return 0;
+}
+
+/*
+ * RT_{SET,GET}_CODEC_EQ_PARAM_IOCTL buffer layout:
+ * pre_gain, post_gain, num_bands, then type, freq, q, gain per band.
+ * Bands not given are switched off.
+ */
+static int rt5648_eq_param_ioctl(struct snd_soc_codec *codec,
+	unsigned int cmd, struct rt_codec_cmd *rt_codec, int *buf)
+{
+	struct rt5648_eq_param p;
+	int i, num;
+
+	if (cmd == RT_GET_CODEC_EQ_PARAM_IOCTL) {
+		if (rt_codec->number < 3 + 4 * RT5648_EQ_BANDS)
+			return -EINVAL;
+		rt5648_eq_get_param(codec, &p);
+		buf[0] = p.pre_gain;
+		buf[1] = p.post_gain;
+		buf[2] = RT5648_EQ_BANDS;
+		for (i = 0; i < RT5648_EQ_BANDS; i++)
+			memcpy(&buf[3 + 4 * i], &p.band[i], sizeof(p.band[i]));
+		if (copy_to_user(rt_codec->buf, buf,
+			sizeof(*buf) * (3 + 4 * RT5648_EQ_BANDS)))
+			return -EFAULT;
+		return 0;
+	}
+
+	if (rt_codec->number < 3)
+		return -EINVAL;
+	num = buf[2];
+	if (num < 0 || num > RT5648_EQ_BANDS ||
+		rt_codec->number < 3 + 4 * num)
+		return -EINVAL;
+
+	rt5648_eq_get_param(codec, &p);
+	p.pre_gain = buf[0];
+	p.post_gain = buf[1];
+	for (i = 0; i < RT5648_EQ_BANDS; i++) {
+		if (i < num)
+			memcpy(&p.band[i], &buf[3 + 4 * i], sizeof(p.band[i]));
+		else
+			p.band[i].type = RT5648_EQ_BAND_OFF;
+	}
+
+	return rt5648_eq_set_param(codec, &p);
+}
+
+/*
+ * buf already holds rt_codec->number entries copied in by the generic
+ * hwdep layer.
+ */
+int rt5648_ioctl_common(struct snd_hwdep *hw, struct file *file,
+			unsigned int cmd, struct rt_codec_cmd *rt_codec,
+			int *buf)
+{
+	struct snd_soc_codec *codec = hw->private_data;
+	struct rt5648_eq *eq = to_rt5648_eq(codec);
+
+	dev_dbg(codec->dev, "%s(): rt_codec.number=%zu, cmd=%u\n",
+			__func__, rt_codec->number, cmd);
+
 	switch (cmd) {
 	case RT_SET_CODEC_HWEQ_IOCTL:
-		if (eq_mode == *buf)
+		if (rt_codec->number < 2 || *buf < 0 || *buf >= EQ_CH_NUM)
+			return -EINVAL;
+		if (eq->req[*buf] == *(buf + 1))
 			break;
-		eq_mode[*buf] = *(buf + 1);
-		rt5648_update_eqmode(codec, eq_mode[*buf], *buf);
-		break;
+		return rt5648_queue_eqmode(codec, *buf, *(buf + 1));
+
+	case RT_SET_CODEC_EQ_PARAM_IOCTL:
+	case RT_GET_CODEC_EQ_PARAM_IOCTL:
+		return rt5648_eq_param_ioctl(codec, cmd, rt_codec, buf);
 
 	case RT_GET_CODEC_ID:
+		if (rt_codec->number < 1)
+			return -EINVAL;
 		*buf = snd_soc_read(codec, RT5648_VENDOR_ID2);
-		if (copy_to_user(rt_codec.buf, buf, sizeof(*buf) * rt_codec.number))
-			goto err;
+		if (copy_to_user(rt_codec->buf, buf,
+			sizeof(*buf) * rt_codec->number))
+			return -EFAULT;
 		break;
 	default:
 		break;
 	}
 
-	kfree(buf);
 	return 0;
-
-err:
-	kfree(buf);
-	return -EFAULT;
 }
 EXPORT_SYMBOL_GPL(rt5648_ioctl_common);
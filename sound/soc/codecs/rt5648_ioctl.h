@@ -49,10 +49,93 @@ typedef struct  hweq_s {
 	unsigned int ctrl;
 } hweq_t;
 
+/*
+ * EQ profile firmware.  A header is followed by num_presets variable
+ * length presets.  All fields are little endian.  A preset replaces the
+ * built-in table entry with the same id for its channel; where several
+ * match, one for the current sample rate wins over one for any rate.
+ */
+#define RT5648_EQ_FW_NAME	"rt5648_eq.bin"
+#define RT5648_EQ_FW_MAGIC	0x51455452 /* "RTEQ" */
+#define RT5648_EQ_FW_VERSION	1
+#define RT5648_EQ_NAME_LEN	16
+
+struct rt5648_eq_fw_hdr {
+	__le32 magic;
+	__le16 version;
+	__le16 num_presets;
+} __packed;
+
+struct rt5648_eq_fw_preset {
+	char name[RT5648_EQ_NAME_LEN];
+	__le16 id;		/* mode passed to rt5648_update_eqmode() */
+	__le16 channel;		/* EQ_CH_* */
+	__le32 rate;		/* sample rate in Hz, 0 for any */
+	__le16 ctrl;		/* EQ_CTRL2 / ADC_EQ_CTRL2 value */
+	__le16 mask;		/* bits of ctrl owned by the preset */
+	__le16 num_coef;	/* 0 leaves the coefficients alone */
+	__le16 coef[];		/* in eqreg[channel] order */
+} __packed;
+
+/* Parsed, resident form of a firmware preset */
+struct rt5648_eq_preset {
+	char name[RT5648_EQ_NAME_LEN];
+	int id;
+	int channel;
+	unsigned int rate;
+	unsigned int ctrl;
+	unsigned int mask;
+	int num_coef;
+	unsigned int coef[EQ_REG_NUM];
+};
+
+/*
+ * Parametric EQ.  rt5648_update_eqmode() with RT5648_EQ_USER programs
+ * coefficients generated from these band parameters for the current
+ * sample rate instead of a table entry.
+ */
+#define RT5648_EQ_USER		0x100
+/* Capture presets for EQ_CH_ADC, generated the same way */
+#define RT5648_EQ_VOICE		0x101
+#define RT5648_EQ_FAR_FIELD	0x102
+#define RT5648_EQ_BANDS		5
+#define RT5648_EQ_GAIN_MAX	120	/* 0.1 dB, H0 must fit Q2.13 */
+#define RT5648_EQ_Q_MIN		10	/* 0.01 */
+#define RT5648_EQ_Q_MAX		2000
+
+enum {
+	RT5648_EQ_BAND_OFF = 0,
+	RT5648_EQ_BAND_LOW_SHELF,
+	RT5648_EQ_BAND_PEAK,
+	RT5648_EQ_BAND_HIGH_SHELF,
+	RT5648_EQ_BAND_TYPES,
+};
+
+struct rt5648_eq_band {
+	int type;	/* RT5648_EQ_BAND_* */
+	int freq;	/* centre / corner frequency in Hz */
+	int q;		/* Q in 0.01 units, peaking bands only */
+	int gain;	/* 0.1 dB */
+};
+
+struct rt5648_eq_param {
+	int pre_gain;	/* 0.1 dB */
+	int post_gain;
+	struct rt5648_eq_band band[RT5648_EQ_BANDS];
+};
+
+void rt5648_eq_fw_request(struct snd_soc_codec *codec);
+void rt5648_eq_fw_release(struct snd_soc_codec *codec);
 int rt5648_ioctl_common(struct snd_hwdep *hw, struct file *file,
-			unsigned int cmd, unsigned long arg);
+			unsigned int cmd, struct rt_codec_cmd *rt_codec,
+			int *buf);
+int rt5648_eq_init(struct snd_soc_codec *codec);
+void rt5648_eq_exit(struct snd_soc_codec *codec);
+int rt5648_eq_add_controls(struct snd_soc_codec *codec);
+int rt5648_queue_eqmode(struct snd_soc_codec *codec, int channel, int mode);
 int rt5648_update_eqmode(
 	struct snd_soc_codec *codec, int channel, int mode);
+int rt5648_preload_eqmode(struct snd_soc_codec *codec, int channel, int mode);
 
 #endif /* __RT5648_IOCTL_H__ */
 
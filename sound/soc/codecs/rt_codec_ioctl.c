@@ -10,9 +10,12 @@
  */
 #define DEBUG 1
 #include <linux/spi/spi.h>
+#include <linux/delay.h>
+#include <linux/mm.h>
 #include <sound/soc.h>
 #include "rt_codec_ioctl.h"
 static struct rt_codec_ops rt_codec_ioctl_ops;
+static DEFINE_SPINLOCK(rt_codec_reg_page_lock);
 #if defined(CONFIG_SND_HWDEP) || defined(CONFIG_SND_HWDEP_MODULE)
 #define RT_CE_CODEC_HWDEP_NAME "rt_codec hwdep "
 static int rt_codec_hwdep_open(struct snd_hwdep *hw, struct file *file)
@@ -27,90 +30,128 @@ static int rt_codec_hwdep_release(struct snd_hwdep *hw, struct file *file)
 	dev_dbg(codec->dev, "%s()\n", __func__);
 	return 0;
 }
+/*
+ * Requests are processed in chunks through an on-stack buffer, so the
+ * common path never allocates.  buf holds the register half of a chunk
+ * in [0, RT_CODEC_CMD_CHUNK) and the value half after it.
+ */
+#define RT_CODEC_CMD_CHUNK 32
+#define RT_CODEC_CMD_MAX 4096
 static int rt_codec_hwdep_ioctl_common(struct snd_hwdep *hw,
 		struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct snd_soc_codec *codec = hw->private_data;
 	struct rt_codec_cmd __user *_rt_codec = (struct rt_codec_cmd *)arg;
 	struct rt_codec_cmd rt_codec;
-	int *buf, *p;
+	int buf[RT_CODEC_CMD_CHUNK * 2];
+	int *reg = buf, *val = buf + RT_CODEC_CMD_CHUNK;
+	size_t half, i, n, j;
 	if (copy_from_user(&rt_codec, _rt_codec, sizeof(rt_codec))) {
 		dev_err(codec->dev,"copy_from_user faild\n");
 		return -EFAULT;
 	}
 	dev_dbg(codec->dev, "%s(): rt_codec.number=%zu, cmd=%u\n",
 			__func__, rt_codec.number, cmd);
-	buf = kmalloc(sizeof(*buf) * rt_codec.number, GFP_KERNEL);
-	if (buf == NULL)
-		return -ENOMEM;
-	if (copy_from_user(buf, rt_codec.buf, sizeof(*buf) * rt_codec.number)) {
-		goto err;
-	}
-	
+	if (rt_codec.number > RT_CODEC_CMD_MAX)
+		return -EINVAL;
+	half = rt_codec.number / 2;
 	switch (cmd) {
-	case RT_READ_CODEC_REG_IOCTL:
-		for (p = buf; p < buf + rt_codec.number / 2; p++) {
-			*(p + rt_codec.number / 2) = snd_soc_read(codec, *p);
-		}
-		if (copy_to_user(rt_codec.buf, buf, sizeof(*buf) * rt_codec.number))
-			goto err;
-		break;		
-	case RT_WRITE_CODEC_REG_IOCTL:
-		for (p = buf; p < buf + rt_codec.number / 2; p++)
-			snd_soc_write(codec, *p, *(p + rt_codec.number / 2));
-		break;
 	case RT_READ_CODEC_INDEX_IOCTL:
 		if (NULL == rt_codec_ioctl_ops.index_read)
-			goto err;
-		for (p = buf; p < buf + rt_codec.number / 2; p++)
-			*(p+rt_codec.number/2) = rt_codec_ioctl_ops.index_read(
-							codec, *p);
-		if (copy_to_user(rt_codec.buf, buf,
-			sizeof(*buf) * rt_codec.number))
-			goto err;
+			return -EFAULT;
+		/* fall through */
+	case RT_READ_CODEC_REG_IOCTL:
+		for (i = 0; i < half; i += n) {
+			n = min_t(size_t, half - i, RT_CODEC_CMD_CHUNK);
+			if (copy_from_user(reg, rt_codec.buf + i,
+				sizeof(*buf) * n))
+				return -EFAULT;
+			for (j = 0; j < n; j++)
+				val[j] = cmd == RT_READ_CODEC_REG_IOCTL ?
+					snd_soc_read(codec, reg[j]) :
+					rt_codec_ioctl_ops.index_read(codec,
+						reg[j]);
+			if (copy_to_user(rt_codec.buf + half + i, val,
+				sizeof(*buf) * n))
+				return -EFAULT;
+		}
 		break;
 	case RT_WRITE_CODEC_INDEX_IOCTL:
 		if (NULL == rt_codec_ioctl_ops.index_write)
-			goto err;
-		for (p = buf; p < buf + rt_codec.number / 2; p++)
-		{
-			dev_dbg(codec->dev, "%x , %x\n",
-				*p,*(p+rt_codec.number/2));
-			rt_codec_ioctl_ops.index_write(codec, *p,
-				*(p+rt_codec.number/2));
+			return -EFAULT;
+		/* fall through */
+	case RT_WRITE_CODEC_REG_IOCTL:
+		for (i = 0; i < half; i += n) {
+			n = min_t(size_t, half - i, RT_CODEC_CMD_CHUNK);
+			if (copy_from_user(reg, rt_codec.buf + i,
+				sizeof(*buf) * n) ||
+				copy_from_user(val, rt_codec.buf + half + i,
+				sizeof(*buf) * n))
+				return -EFAULT;
+			for (j = 0; j < n; j++) {
+				dev_dbg(codec->dev, "%x , %x\n", reg[j], val[j]);
+				if (cmd == RT_WRITE_CODEC_REG_IOCTL)
+					snd_soc_write(codec, reg[j], val[j]);
+				else
+					rt_codec_ioctl_ops.index_write(codec,
+						reg[j], val[j]);
+			}
 		}
-		break;		
+		break;
 	default:
+		/* codec specific commands are small, hand over the copy */
 		if (NULL == rt_codec_ioctl_ops.ioctl_common)
-			goto err;
-		rt_codec_ioctl_ops.ioctl_common(hw, file, cmd, arg);
-		break;
+			return -EFAULT;
+		if (rt_codec.number > ARRAY_SIZE(buf))
+			return -E2BIG;
+		if (copy_from_user(buf, rt_codec.buf,
+			sizeof(*buf) * rt_codec.number))
+			return -EFAULT;
+		return rt_codec_ioctl_ops.ioctl_common(hw, file, cmd,
+			&rt_codec, buf);
 	}
-	kfree(buf);
 	return 0;
-err:
-	kfree(buf);
-	return -EFAULT;
 }
+/*
+ * Keeps the original layout: number is the size of the whole buffer, the
+ * first half holds the addresses (every other register) and the second
+ * half the values.  The caller's buffer must be large enough for it.
+ */
 static int rt_codec_codec_dump_reg(struct snd_hwdep *hw,
 		struct file *file, unsigned long arg)
 {
 	struct snd_soc_codec *codec = hw->private_data;
+	struct rt_codec_reg_page *page = NULL;
 	struct rt_codec_cmd __user *_rt_codec =(struct rt_codec_cmd *)arg;
 	struct rt_codec_cmd rt_codec;
-	int i, *buf, number = codec->driver->reg_cache_size;
+	int i, *buf, number = RT_CODEC_REG_PAGE_NUM;
+	unsigned int seq;
 	dev_dbg(codec->dev, "enter %s, number = %d\n", __func__, number);
 	if (copy_from_user(&rt_codec, _rt_codec, sizeof(rt_codec)))
 		return -EFAULT;
+	if (rt_codec.number < number)
+		return -EINVAL;
+	if (rt_codec_ioctl_ops.get_reg_page)
+		page = rt_codec_ioctl_ops.get_reg_page(codec);
 	
 	buf = kmalloc(sizeof(*buf) * number, GFP_KERNEL);
 	if (buf == NULL)
 		return -ENOMEM;
-	for (i = 0; i < number/2; i++) {
+	for (i = 0; i < number / 2; i++)
 		buf[i] = i << 1;
-		buf[i + number / 2] = codec->driver->read(codec, buf[i]);
+	if (page) {
+		do {
+			seq = ACCESS_ONCE(page->seq);
+			smp_rmb();
+			for (i = 0; i < number / 2; i++)
+				buf[i + number / 2] = page->reg[buf[i]];
+			smp_rmb();
+		} while ((seq & 1) || seq != ACCESS_ONCE(page->seq));
+	} else {
+		for (i = 0; i < number / 2; i++)
+			buf[i + number / 2] = snd_soc_read(codec, buf[i]);
 	}
-	if (copy_to_user(rt_codec.buf, buf, sizeof(*buf) * i))
+	if (copy_to_user(rt_codec.buf, buf, sizeof(*buf) * number))
 		goto err;
 	rt_codec.number = number;
 	if (copy_to_user(_rt_codec, &rt_codec, sizeof(rt_codec)))
@@ -121,17 +162,194 @@ err:
 	kfree(buf);
 	return -EFAULT;
 }
+#define RT_CODEC_PROG_BURST 32
+static int rt_codec_prog_delay(u32 delay_us)
+{
+	if (!delay_us)
+		return 0;
+	if (delay_us < 20000)
+		usleep_range(delay_us, delay_us + delay_us / 8 + 1);
+	else
+		msleep(DIV_ROUND_UP(delay_us, 1000));
+	return 0;
+}
+/*
+ * Queue runs of index writes with no delay in between so they go out
+ * through index_bulk_write() in as few bus transfers as possible.
+ */
+static int rt_codec_prog_index_run(struct snd_soc_codec *codec,
+		struct rt_codec_prog_op *op, int num, int *done)
+{
+	unsigned int reg[RT_CODEC_PROG_BURST], val[RT_CODEC_PROG_BURST];
+	int n = 0, ret;
+	while (n < num && n < RT_CODEC_PROG_BURST &&
+		op[n].op == RT_CODEC_OP_WRITE &&
+		op[n].space == RT_CODEC_SPACE_INDEX) {
+		reg[n] = op[n].reg;
+		val[n] = op[n].value;
+		if (op[n++].delay_us)
+			break;
+	}
+	ret = rt_codec_ioctl_ops.index_bulk_write(codec, reg, val, n);
+	if (ret < 0)
+		return ret;
+	*done = n;
+	return rt_codec_prog_delay(op[n - 1].delay_us);
+}
+static int rt_codec_prog_read(struct snd_soc_codec *codec,
+		struct rt_codec_prog_op *op)
+{
+	unsigned int value;
+	int ret;
+	if (NULL == rt_codec_ioctl_ops.reg_read)
+		return -ENXIO;
+	ret = rt_codec_ioctl_ops.reg_read(codec, op->space, op->reg, &value);
+	if (ret < 0)
+		return ret;
+	op->value = value;
+	return 0;
+}
+static int rt_codec_prog_exec(struct snd_soc_codec *codec,
+		struct rt_codec_prog_op *op)
+{
+	int ret;
+	switch (op->space) {
+	case RT_CODEC_SPACE_REG:
+		switch (op->op) {
+		case RT_CODEC_OP_NOP:
+			ret = 0;
+			break;
+		case RT_CODEC_OP_READ:
+			ret = rt_codec_prog_read(codec, op);
+			break;
+		case RT_CODEC_OP_WRITE:
+			ret = snd_soc_write(codec, op->reg, op->value);
+			break;
+		case RT_CODEC_OP_UPDATE_BITS:
+			ret = snd_soc_update_bits(codec, op->reg, op->mask,
+				op->value);
+			break;
+		default:
+			return -EINVAL;
+		}
+		break;
+	case RT_CODEC_SPACE_INDEX:
+		switch (op->op) {
+		case RT_CODEC_OP_NOP:
+			ret = 0;
+			break;
+		case RT_CODEC_OP_READ:
+			ret = rt_codec_prog_read(codec, op);
+			break;
+		case RT_CODEC_OP_WRITE:
+			if (NULL == rt_codec_ioctl_ops.index_write)
+				return -ENXIO;
+			ret = rt_codec_ioctl_ops.index_write(codec, op->reg,
+				op->value);
+			break;
+		case RT_CODEC_OP_UPDATE_BITS:
+			if (NULL == rt_codec_ioctl_ops.index_update_bits)
+				return -ENXIO;
+			ret = rt_codec_ioctl_ops.index_update_bits(codec,
+				op->reg, op->mask, op->value);
+			break;
+		default:
+			return -EINVAL;
+		}
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (ret < 0)
+		return ret;
+	return rt_codec_prog_delay(op->delay_us);
+}
+/*
+ * Run a program of register/index operations under the codec's prog_lock
+ * (see struct rt_codec_prog_op for what that guarantees).  On return
+ * number holds the count of records executed, so a failing record can be
+ * located by the caller.
+ */
+static int rt_codec_hwdep_run_prog(struct snd_hwdep *hw,
+		struct file *file, unsigned long arg)
+{
+	struct snd_soc_codec *codec = hw->private_data;
+	struct rt_codec_cmd __user *_rt_codec = (struct rt_codec_cmd *)arg;
+	struct rt_codec_cmd rt_codec;
+	struct rt_codec_prog_op *prog;
+	int i, n, ret = 0;
+	if (copy_from_user(&rt_codec, _rt_codec, sizeof(rt_codec)))
+		return -EFAULT;
+	if (!rt_codec.number || rt_codec.number > RT_CODEC_PROG_MAX)
+		return -EINVAL;
+	prog = kmalloc(sizeof(*prog) * rt_codec.number, GFP_KERNEL);
+	if (prog == NULL)
+		return -ENOMEM;
+	if (copy_from_user(prog, rt_codec.buf,
+		sizeof(*prog) * rt_codec.number)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	if (rt_codec_ioctl_ops.prog_lock)
+		rt_codec_ioctl_ops.prog_lock(codec);
+	for (i = 0; i < rt_codec.number; i += n) {
+		n = 1;
+		if (prog[i].op == RT_CODEC_OP_WRITE &&
+			prog[i].space == RT_CODEC_SPACE_INDEX &&
+			rt_codec_ioctl_ops.index_bulk_write)
+			ret = rt_codec_prog_index_run(codec, prog + i,
+				rt_codec.number - i, &n);
+		else
+			ret = rt_codec_prog_exec(codec, prog + i);
+		if (ret < 0)
+			break;
+	}
+	if (rt_codec_ioctl_ops.prog_unlock)
+		rt_codec_ioctl_ops.prog_unlock(codec);
+	dev_dbg(codec->dev, "%s(): ran %d of %zu ops, ret=%d\n",
+		__func__, i, rt_codec.number, ret);
+	rt_codec.number = i;
+	if (copy_to_user(rt_codec.buf, prog, sizeof(*prog) * i) ||
+		copy_to_user(_rt_codec, &rt_codec, sizeof(rt_codec)))
+		ret = -EFAULT;
+out:
+	kfree(prog);
+	return ret;
+}
 static int rt_codec_hwdep_ioctl(struct snd_hwdep *hw, struct file *file,
 			unsigned int cmd, unsigned long arg)
 {
 	switch (cmd) {
 	case RT_READ_ALL_CODEC_REG_IOCTL:
 		return rt_codec_codec_dump_reg(hw, file, arg);
+	case RT_RUN_CODEC_PROG_IOCTL:
+		return rt_codec_hwdep_run_prog(hw, file, arg);
 	default:
 		return rt_codec_hwdep_ioctl_common(hw, file, cmd, arg);
 	}
 	return 0;
 }
+/*
+ * The mirror is inserted as a normal page so every mapping holds its own
+ * reference; it stays valid after the codec drops its one in
+ * rt_codec_reg_page_free() until the last mapping goes away.
+ */
+static int rt_codec_hwdep_mmap(struct snd_hwdep *hw, struct file *file,
+		struct vm_area_struct *vma)
+{
+	struct snd_soc_codec *codec = hw->private_data;
+	struct rt_codec_reg_page *page = NULL;
+	if (rt_codec_ioctl_ops.get_reg_page)
+		page = rt_codec_ioctl_ops.get_reg_page(codec);
+	if (page == NULL)
+		return -ENXIO;
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(page));
+}
 int realtek_ce_init_hwdep(struct snd_soc_codec *codec)
 {
 	struct snd_hwdep *hw;
@@ -146,10 +364,60 @@ int realtek_ce_init_hwdep(struct snd_soc_codec *codec)
 	hw->ops.open = rt_codec_hwdep_open;
 	hw->ops.release = rt_codec_hwdep_release;
 	hw->ops.ioctl = rt_codec_hwdep_ioctl;
+	hw->ops.mmap = rt_codec_hwdep_mmap;
 	return 0;
 }
 EXPORT_SYMBOL_GPL(realtek_ce_init_hwdep);
 #endif
+struct rt_codec_reg_page *rt_codec_reg_page_alloc(void)
+{
+	struct rt_codec_reg_page *page;
+	struct page *pg;
+	BUILD_BUG_ON(sizeof(*page) > PAGE_SIZE);
+	pg = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if (pg == NULL)
+		return NULL;
+	page = page_address(pg);
+	page->reg_num = RT_CODEC_REG_PAGE_NUM;
+	return page;
+}
+EXPORT_SYMBOL_GPL(rt_codec_reg_page_alloc);
+/* Drop the codec's reference, live mappings keep the page until unmapped */
+void rt_codec_reg_page_free(struct rt_codec_reg_page *page)
+{
+	if (page)
+		put_page(virt_to_page(page));
+}
+EXPORT_SYMBOL_GPL(rt_codec_reg_page_free);
+/*
+ * Record a register value in the mmap()ed mirror.  space is one of
+ * RT_CODEC_SPACE_REG or RT_CODEC_SPACE_INDEX.
+ */
+void rt_codec_reg_page_update(struct rt_codec_reg_page *page, int space,
+	unsigned int reg, unsigned int value)
+{
+	unsigned long flags;
+	__u16 *val;
+	__u32 *valid;
+	if (page == NULL || reg >= RT_CODEC_REG_PAGE_NUM)
+		return;
+	if (space == RT_CODEC_SPACE_INDEX) {
+		val = page->index;
+		valid = page->index_valid;
+	} else {
+		val = page->reg;
+		valid = page->reg_valid;
+	}
+	spin_lock_irqsave(&rt_codec_reg_page_lock, flags);
+	page->seq++;
+	smp_wmb();
+	val[reg] = value;
+	valid[reg / 32] |= 1U << (reg % 32);
+	smp_wmb();
+	page->seq++;
+	spin_unlock_irqrestore(&rt_codec_reg_page_lock, flags);
+}
+EXPORT_SYMBOL_GPL(rt_codec_reg_page_update);
 struct rt_codec_ops *rt_codec_get_ioctl_ops(void)
 {
 	return &rt_codec_ioctl_ops;
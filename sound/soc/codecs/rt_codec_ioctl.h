@@ -16,6 +16,51 @@ struct rt_codec_cmd {
 	size_t number;
 	int __user *buf;
 };
+/*
+ * One record of an RT_RUN_CODEC_PROG_IOCTL program.  The ioctl takes a
+ * struct rt_codec_cmd whose buf points at an array of number records.
+ * Read results are returned in value.  delay_us is waited after the op.
+ *
+ * The whole program runs under the codec's prog_lock, when it provides
+ * one.  No other register access of the driver (DAPM, controls, works,
+ * other ioctls) lands between two records, delays included.  The lock
+ * does not cover what the hardware does on its own, and records that
+ * already ran are not undone when a later one fails.  Without prog_lock
+ * programs are not serialised at all.
+ */
+struct rt_codec_prog_op {
+	__u8 op;
+	__u8 space;
+	__u16 reg;
+	__u16 mask;
+	__u16 value;
+	__u32 delay_us;
+};
+enum {
+	RT_CODEC_OP_NOP = 0,
+	RT_CODEC_OP_READ,
+	RT_CODEC_OP_WRITE,
+	RT_CODEC_OP_UPDATE_BITS,
+};
+enum {
+	RT_CODEC_SPACE_REG = 0,
+	RT_CODEC_SPACE_INDEX,
+};
+#define RT_CODEC_PROG_MAX 1024
+/*
+ * Read-only register mirror exported through mmap() on the hwdep node.
+ * seq is odd while an update is in progress; readers retry until they
+ * see the same even value before and after copying.
+ */
+#define RT_CODEC_REG_PAGE_NUM 0x100
+struct rt_codec_reg_page {
+	__u32 seq;
+	__u32 reg_num;
+	__u16 reg[RT_CODEC_REG_PAGE_NUM];
+	__u16 index[RT_CODEC_REG_PAGE_NUM];
+	__u32 reg_valid[RT_CODEC_REG_PAGE_NUM / 32];
+	__u32 index_valid[RT_CODEC_REG_PAGE_NUM / 32];
+};
 struct rt_codec_ops {
 	int (*index_write)(struct snd_soc_codec *codec,
 		unsigned int reg, unsigned int value);
@@ -23,8 +68,18 @@ struct rt_codec_ops {
 				unsigned int reg);
 	int (*index_update_bits)(struct snd_soc_codec *codec,
 		unsigned int reg, unsigned int mask, unsigned int value);
+	int (*index_bulk_write)(struct snd_soc_codec *codec,
+		const unsigned int *reg, const unsigned int *value, int num);
+	/* regmap_read() of a RT_CODEC_SPACE_* register, 0 or -errno */
+	int (*reg_read)(struct snd_soc_codec *codec, int space,
+		unsigned int reg, unsigned int *value);
 	int (*ioctl_common)(struct snd_hwdep *hw, struct file *file,
-			unsigned int cmd, unsigned long arg);
+			unsigned int cmd, struct rt_codec_cmd *rt_codec,
+			int *buf);
+	struct rt_codec_reg_page *(*get_reg_page)(struct snd_soc_codec *codec);
+	/* held around a whole RT_RUN_CODEC_PROG_IOCTL program */
+	void (*prog_lock)(struct snd_soc_codec *codec);
+	void (*prog_unlock)(struct snd_soc_codec *codec);
 };
 enum {
 	RT_READ_CODEC_REG_IOCTL = _IOR('R', 0x01, struct rt_codec_cmd),
@@ -64,8 +119,15 @@ enum {
 	RT_GET_CODEC_NOISE_GATE_IOCTL = _IOR('R', 0x12, struct rt_codec_cmd),
 	RT_SET_CODEC_DRC_AGC_COMP_IOCTL = _IOW('R', 0x13, struct rt_codec_cmd),
 	RT_GET_CODEC_DRC_AGC_COMP_IOCTL = _IOR('R', 0x13, struct rt_codec_cmd),
+	RT_SET_CODEC_EQ_PARAM_IOCTL = _IOW('R', 0x14, struct rt_codec_cmd),
+	RT_GET_CODEC_EQ_PARAM_IOCTL = _IOR('R', 0x14, struct rt_codec_cmd),
+	RT_RUN_CODEC_PROG_IOCTL = _IOWR('R', 0x20, struct rt_codec_cmd),
 	RT_GET_CODEC_ID = _IOR('R', 0x30, struct rt_codec_cmd),
 };
 int realtek_ce_init_hwdep(struct snd_soc_codec *codec);
+struct rt_codec_reg_page *rt_codec_reg_page_alloc(void);
+void rt_codec_reg_page_free(struct rt_codec_reg_page *page);
+void rt_codec_reg_page_update(struct rt_codec_reg_page *page, int space,
+	unsigned int reg, unsigned int value);
 struct rt_codec_ops *rt_codec_get_ioctl_ops(void);
 #endif /* __RT56XX_IOCTL_H__ */